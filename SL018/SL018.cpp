@@ -14,6 +14,32 @@
 #include <string.h>
 #include "SL018.h"
 
+#if defined(__AVR__)
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#else
+// interrupts are always enabled after the block, the previous state is not restored
+#define ATOMIC_BLOCK(type) for (byte once = (noInterrupts(), 1); once; once = 0, interrupts())
+#endif
+
+#if defined(__AVR__)
+// memcmp() for a second operand in EEPROM, used by findTagInEEPROM()
+static int memcmp_E(const void* s1, const void* s2, size_t n)
+{
+	const byte* p = (const byte*)s1;
+	const byte* e = (const byte*)s2;
+	for (; n; n--, p++, e++)
+	{
+		byte b = eeprom_read_byte(e);
+		if (*p != b)
+			return *p < b ? -1 : 1;
+	}
+	return 0;
+}
+#endif
+
 // local prototypes
 void arrayToHex(char *s, byte array[], byte len);
 char toHex(byte b);
@@ -33,6 +59,25 @@ SL018::SL018()
 	cmd = CMD_IDLE;
 	debug = false;
 	t = millis() + 10;
+	idleTime = 0;
+	tagList = 0;
+	tagListCount = 0;
+	tagListInUse = 0;
+	commands = responses = polls = busBytes = 0;
+	staleResponses = 0;
+	memset(phaseTime, 0, sizeof(phaseTime));
+	tResponse = 0;
+	tBus = 0;
+	selects = detections = lostTags = collisions = 0;
+	authFailures = readFailures = 0;
+	memset(sectorFailures, 0, sizeof(sectorFailures));
+	memset(firstReads, 0, sizeof(firstReads));
+	readPending = false;
+	waiting = false;
+	ledState = ledSent = 0xff;
+	sessionType = 0;
+	local = false;
+	pending = false;
 }
 
 /* Public member functions ****************************************************/
@@ -70,10 +115,16 @@ void SL018::reset()
 	else // software reset
 	{
 		sendCommand(CMD_RESET);
+		sendPending();
 	}
 
 	// Allow enough time for reset
 	delay(200);
+
+	// No response is expected, and the LED state is unknown after reset
+	waiting = false;
+	pending = false;
+	ledSent = 0xff;
 }
 
 /**	Checks for availability of a valid response packet.
@@ -81,10 +132,38 @@ void SL018::reset()
  *	This function should always be called and return true prior to using results
  *	of a command.
  *
+ *	It never waits for the pacing slot: until the next I2C slot is reached,
+ *	it returns false without touching the bus, so it can be polled from
+ *	loop() without blocking other work. A command waiting for its slot is
+ *	sent from here, see transmitData().
+ *
  *	@returns	true if a valid response packet is available
  */
 boolean SL018::available()
 {
+	// Send pending output changes in a free slot between tag commands: when no
+	// tag command is outstanding, or between the SELECT retries of a seek
+	if (outputFree() && flushOutput())
+	{
+		return false;
+	}
+
+	// Send a queued command in its slot, its response is polled in the next one
+	if (pending)
+	{
+		if (slotFree())
+			sendPending();
+		return false;
+	}
+
+	// Nothing to poll while no response is outstanding
+	if (!waiting)
+		return false;
+
+	// Poll the module only in a free slot, instead of waiting for it
+	if (!local && !slotFree())
+		return false;
+
 	// Set the maximum length of the expected response packet
 	byte len;
 	switch(cmd)
@@ -118,23 +197,35 @@ boolean SL018::available()
 		len = SIZE_PACKET;
 	}
 
-	// If valid data received, process the response packet
-	if (len && receiveData(len) > 0)
+	// If valid data received (a SEEK is answered as SELECT), or a response was
+	// made up, process the response packet
+	if (local || (len && receiveData(len, cmd == CMD_SEEK ? CMD_SELECT : cmd, data) > 0))
 	{
+		unsigned long start = micros();
+		waiting = false;
+
 		// Init response variables
 		tagType = tagLength = *tagString = 0;
 		errorCode = data[2];
 
+		// Update the reliability counters, unless the response was made up
+		if (local)
+			local = false;
+		else
+			countResult();
+
 		// Process command response
 		switch (getCommand())
 		{
 		case CMD_SEEK:
 		case CMD_SELECT:
 			// If no error, get tag number
+			// The tag type determines which commands are sent, see routeCommand()
+			sessionType = 0;
 			if(errorCode == 0 && getPacketLength() >= 7)
 			{
 				tagLength = getPacketLength() - 3;
-				tagType = data[getPacketLength()];
+				tagType = sessionType = data[getPacketLength()];
 				memcpy(tagNumber, data + 3, tagLength);
 				arrayToHex(tagString, tagNumber, tagLength);
 			}
@@ -146,12 +237,108 @@ boolean SL018::available()
 			}
 		}
 		// Data is available
+		addPhase(PHASE_DECODE, start);
+		tResponse = micros();
 		return true;
 	}
 	// No data available
 	return false;
 }
 
+/**	Look up the tag number in a sorted list of tag numbers.
+ *
+ *	The list is stored in program memory (PROGMEM) as packed tag numbers in
+ *	ascending byte order, each with the length of the current tag number
+ *	(4 or 7 bytes), so separate lists are needed for each length.
+ *	A binary search is used, the list is not copied to RAM.
+ *	Only valid right after available() returned a SEEK or SELECT response.
+ *
+ *	@param	list	pointer to the list in program memory
+ *	@param	count	number of tag numbers in the list
+ *	@return	true if the tag number is in the list
+ */
+boolean SL018::findTag(const byte* list, unsigned int count)
+{
+#if defined(__AVR__)
+	return searchTag(list, count, memcmp_P);
+#else
+	// program memory is addressed like RAM, memcmp_P() may be a function-like macro here
+	return searchTag(list, count, memcmp);
+#endif
+}
+
+/**	Look up the tag number in a sorted list of tag numbers in EEPROM.
+ *
+ *	The list has the same format as for findTag(). A binary search is used,
+ *	reading only the entries it compares, so a lookup in a list of n tag
+ *	numbers reads about log2(n) entries. Only implemented on AVR, other
+ *	architectures return false.
+ *
+ *	@param	eeAddress	EEPROM address of the list
+ *	@param	count	number of tag numbers in the list
+ *	@return	true if the tag number is in the list
+ */
+boolean SL018::findTagInEEPROM(int eeAddress, unsigned int count)
+{
+#if defined(__AVR__)
+	return searchTag((const byte*)eeAddress, count, memcmp_E);
+#else
+	(void)eeAddress;
+	(void)count;
+	return false;
+#endif
+}
+
+/**	Publish a list of tag numbers in RAM for isTagListed().
+ *
+ *	The list has the same format as for findTag(), and may be replaced at any
+ *	time without locking out lookups: the list pointer and count are swapped
+ *	with interrupts disabled, and a lookup takes a snapshot of both before
+ *	searching. On AVR the list may also be replaced from an interrupt handler.
+ *	Other architectures always enable interrupts again after the swap, so
+ *	there it must only be replaced from loop().
+ *	The previous list is returned. Its buffer can be reused for the next
+ *	update as soon as isTagListInUse() returns false for it, no new lookup
+ *	starts on it. When lookups and updates are both done from loop(), that
+ *	is immediately.
+ *
+ *	@param	list	pointer to the new list, or 0 for an empty list
+ *	@param	count	number of tag numbers in the list
+ *	@return	pointer to the previous list
+ */
+const byte* SL018::setTagList(const byte* list, unsigned int count)
+{
+	const byte* old;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		old = tagList;
+		tagList = list;
+		tagListCount = count;
+	}
+	return old;
+}
+
+/**	Look up the tag number in the list published by setTagList().
+ *
+ *	Only valid right after available() returned a SEEK or SELECT response.
+ *
+ *	@return	true if the tag number is in the list
+ */
+boolean SL018::isTagListed()
+{
+	const byte* list;
+	unsigned int count;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		list = tagList;
+		count = tagListCount;
+		tagListInUse = list;
+	}
+	boolean found = list != 0 && searchTag(list, count, memcmp);
+	tagListInUse = 0;
+	return found;
+}
+
 /**	Get error message for last command.
  *
  *	@return	Human-readable error message as a null-terminated string
@@ -183,17 +370,29 @@ const char* SL018::getErrorMessage()
 		return "Not authenticated";
 	case 0x0E:
 		return "Not a value block";
+	case UNSUPPORTED:
+		return "Not supported by tag type";
 	default:
 		return "Unknown error";
 	}
 }
 
 /** Authenticate with transport key (0xFFFFFFFFFFFF).
+ *
+ *	For a Mifare Ultralight, LOGIN_OK is returned without sending a command.
  *
  *	@param sector Sector number
  */
 void SL018::authenticate(byte sector)
 {
+	if (sessionType == MIFARE_ULTRALIGHT)
+	{
+		// Mifare Ultralight needs no authentication
+		localResponse(CMD_LOGIN, LOGIN_OK);
+		return;
+	}
+	if (routeCommand(CMD_LOGIN))
+		return;
 	data[0] = 9;
 	data[1] = CMD_LOGIN;
 	data[2] = sector;
@@ -210,6 +409,14 @@ void SL018::authenticate(byte sector)
  */
 void SL018::authenticate(byte sector, byte keyType, byte key[6])
 {
+	if (sessionType == MIFARE_ULTRALIGHT)
+	{
+		// Mifare Ultralight needs no authentication
+		localResponse(CMD_LOGIN, LOGIN_OK);
+		return;
+	}
+	if (routeCommand(CMD_LOGIN))
+		return;
 	data[0] = 9;
 	data[1] = CMD_LOGIN;
 	data[2] = sector;
@@ -219,11 +426,21 @@ void SL018::authenticate(byte sector, byte keyType, byte key[6])
 }
 
 /**	Read 16-byte block.
+ *
+ *	For a Mifare Ultralight, a 4-byte page is read instead (CMD_READ4).
  *
  *	@param block Block number
  */
 void SL018::readBlock(byte block)
 {
+	if (sessionType == MIFARE_ULTRALIGHT)
+	{
+		// Mifare Ultralight has 4-byte pages
+		readPage(block);
+		return;
+	}
+	if (routeCommand(CMD_READ16))
+		return;
 	data[0] = 2;
 	data[1] = CMD_READ16;
 	data[2] = block;
@@ -236,6 +453,8 @@ void SL018::readBlock(byte block)
  */
 void SL018::readPage(byte page)
 {
+	if (routeCommand(CMD_READ4))
+		return;
 	data[0] = 2;
 	data[1] = CMD_READ4;
 	data[2] = page;
@@ -252,6 +471,8 @@ void SL018::readPage(byte page)
  */
 void SL018::writeBlock(byte block, const char* message)
 {
+	if (routeCommand(CMD_WRITE16))
+		return;
 	data[0] = 18;
 	data[1] = CMD_WRITE16;
 	data[2] = block;
@@ -270,6 +491,8 @@ void SL018::writeBlock(byte block, const char* message)
  */
 void SL018::writePage(byte page, const char* message)
 {
+	if (routeCommand(CMD_WRITE4))
+		return;
 	data[0] = 6;
 	data[1] = CMD_WRITE4;
 	data[2] = page;
@@ -286,6 +509,8 @@ void SL018::writePage(byte page, const char* message)
  */
 void SL018::writeKey(byte sector, byte key[6])
 {
+	if (routeCommand(CMD_WRITE_KEY))
+		return;
 	data[0] = 8;
 	data[1] = CMD_WRITE_KEY;
 	data[2] = sector;
@@ -294,15 +519,61 @@ void SL018::writeKey(byte sector, byte key[6])
 }
 
 /**	Control red LED on SL018 (not implemented on SL030).
+ *
+ *	The LED state is cached, and only sent to the module when it changes.
+ *	To not interfere with tag commands, it is only sent right away when no
+ *	tag command is outstanding and the slot is free. Otherwise available()
+ *	sends it in a free slot between tag commands: after the response has been
+ *	received, or between the SELECT retries of a seek.
+ *	The response to the LED command is not polled, the next tag command drops
+ *	it as stale. The response to the last tag command is left intact.
  *
  *	@param on	true for on, false for off
  */
 void SL018::led(boolean on)
 {
-	data[0] = 2;
-	data[1] = CMD_SET_LED;
-	data[2] = on;
-	transmitData();
+	ledState = on;
+	if (outputFree())
+	{
+		flushOutput();
+	}
+}
+
+/**	Idle the MCU while no reader event is due.
+ *
+ *	Puts the MCU in idle sleep until the next interrupt, unless a response can
+ *	be polled right now. The millis() timer interrupt wakes the MCU at least
+ *	every millisecond, so this function may be called from loop() whenever
+ *	available() returns false, instead of busy polling.
+ *	Time spent sleeping is accumulated, see getIdleTime().
+ */
+void SL018::idle()
+{
+	// Nothing is due if no command, response or output is pending, or the next slot is ahead
+	if ((!waiting && !pending && ledState == ledSent) || !slotFree())
+	{
+		sleepMCU();
+	}
+}
+
+/**	Print the transaction and reliability counters.
+ *
+ *	The counters are printed to Serial in Prometheus/OpenMetrics text format,
+ *	labeled with the I2C address of the reader, e.g.
+ *	<code>sl018_commands_total{address="80"} 1234</code>
+ *	Idle and phase times are in microseconds, and wrap around like micros().
+ *	The phases split the time of each transaction, see getPhaseTime().
+ */
+void SL018::printStats()
+{
+	printMetric("commands", commands);
+	printMetric("responses", responses);
+	printMetric("polls", polls);
+	printMetric("stale_responses", staleResponses);
+	printMetric("bus_bytes", busBytes);
+	printMetric("idle_microseconds", idleTime);
+	printPhases();
+	printReliability();
 }
 
 /**	Send 1-byte command.
@@ -319,92 +590,461 @@ void SL018::sendCommand(byte cmd)
 /* Private member functions ****************************************************/
 
 
-/**	Transmit a packet to the SL018.
+/**	Route a command by the type of the selected tag.
+ *
+ *	The tag type is known from the last SEEK or SELECT response. Commands that
+ *	need Mifare Classic or Ultralight memory cannot succeed on ISO14443-4 tags
+ *	(Mifare Pro, ProX and DESFire). Instead of a failing transaction and a
+ *	reselect, they are answered locally with error code UNSUPPORTED.
+ *
+ *	@param	command	the command to route
+ *	@return	true if the command was answered locally and must not be sent
  */
- /*
- 	data[0] = 18;
-	data[1] = CMD_WRITE16;
-	data[2] = block;
-	strncpy((char*)data + 3, message, 15);
-	data[18] = 0;
-	*/
-void SL018::transmitData()
+boolean SL018::routeCommand(byte command)
 {
-	// wait until at least 20ms passed since last I2C transmission
-	while(t > millis());
-	t = millis() + 20;
+	switch (sessionType)
+	{
+	case MIFARE_PRO:
+	case MIFARE_PROX:
+	case MIFARE_DESFIRE:
+		localResponse(command, UNSUPPORTED);
+		return true;
+	}
+	return false;
+}
 
-	// remember which command was sent
-	cmd = data[1];
+/**	Make up a response to a command that is not sent to the module.
+ *
+ *	The response is returned by the next call of available().
+ *
+ *	@param	command	the command to respond to
+ *	@param	status	status code of the response
+ */
+void SL018::localResponse(byte command, byte status)
+{
+	data[0] = 2;
+	data[1] = command;
+	data[2] = status;
+	cmd = command;
+	waiting = true;
+	local = true;
+}
+
+/**	Send pending output changes.
+ *
+ *	Output commands use their own packet buffer, so the response to the last
+ *	tag command stays valid. Their response is not polled, which would cost
+ *	another slot, but dropped as stale by the next tag command.
+ *	Must only be called when outputFree() is true.
+ *
+ *	@return	true if the slot was used
+ */
+boolean SL018::flushOutput()
+{
+	if (ledState != ledSent)
+	{
+		byte packet[] = { 2, CMD_SET_LED, ledState };
+		ledSent = ledState;
+		waitForSlot();
+		writePacket(packet);
+		return true;
+	}
+	return false;
+}
+
+/**	Send the command waiting for its slot.
+ *
+ *	Waits for the slot if it has not been reached yet, which only happens
+ *	when a command is sent before available() got the chance to send the
+ *	previous one, e.g. during a software reset.
+ */
+void SL018::sendPending()
+{
+	if (!pending)
+		return;
+
+	waitForSlot();
+	addPhase(PHASE_SLOT, tQueued);
+	pending = false;
+	target = out[2];
+	writePacket(out);
+}
+
+/**	Write a packet to the SL018.
+ *
+ *	@param	packet	length byte, command and parameters
+ */
+void SL018::writePacket(const byte* packet)
+{
+	// count command and bytes on the bus, including address byte
+	commands++;
+	if (packet[1] == CMD_SELECT)
+		selects++;
+	busBytes += packet[0] + 2;
 
 	// transmit packet with checksum
+	unsigned long start = micros();
 	Wire.beginTransmission(address);
 		
-	for (int i = 0; i <= data[0]; i++)
+	for (int i = 0; i <= packet[0]; i++)
 	{
 #if defined(ARDUINO) && ARDUINO >= 100
-		Wire.write(data[i]);
+		Wire.write(packet[i]);
 #else
-		Wire.send(data[i]);
+		Wire.send(packet[i]);
 #endif
 	}
 	Wire.endTransmission();
+	tBus = micros();
+	addPhase(PHASE_WRITE, start);
 
 	// show transmitted packet for debugging
 	if (debug)
 	{
 		Serial.print("> ");
-		printArrayHex( data, data[0] + 1);
+		printArrayHex((byte*)packet, packet[0] + 1);
 		Serial.println();
 	}
 }
 
+/**	Wait until the next I2C slot has been reached.
+ *
+ *	The MCU is put in idle sleep while waiting. The slot after this one is
+ *	reserved 20ms ahead.
+ */
+void SL018::waitForSlot()
+{
+	while (!slotFree())
+	{
+		sleepMCU();
+	}
+	t = millis() + 20;
+}
+
+/**	Binary search for the tag number in a sorted list.
+ *
+ *	@param	list	pointer to the list
+ *	@param	count	number of tag numbers in the list
+ *	@param	compare	memcmp() for a list in RAM, or memcmp_P() for a list in program memory
+ *	@return	true if the tag number is in the list
+ */
+boolean SL018::searchTag(const byte* list, unsigned int count, int (*compare)(const void*, const void*, size_t))
+{
+	unsigned int lo = 0, hi = count;
+	while (tagLength && lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		int diff = compare(tagNumber, list + mid * tagLength, tagLength);
+		if (diff == 0)
+			return true;
+		if (diff < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return false;
+}
+
+/**	Put the MCU in idle sleep until the next interrupt.
+ *
+ *	Only implemented on AVR, other architectures return immediately.
+ */
+void SL018::sleepMCU()
+{
+#if defined(__AVR__)
+	unsigned long start = micros();
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
+	idleTime += micros() - start;
+#endif
+}
+
+/**	Transmit a packet to the SL018.
+ *
+ *	The packet is sent right away if the slot is free. Otherwise it is
+ *	queued, and sent by available() once the slot is reached, so sending a
+ *	command never waits for the pacing. A command that is still queued when
+ *	the next one is sent goes out first, in its slot.
+ */
+ /*
+ 	data[0] = 18;
+	data[1] = CMD_WRITE16;
+	data[2] = block;
+	strncpy((char*)data + 3, message, 15);
+	data[18] = 0;
+	*/
+void SL018::transmitData()
+{
+	// the application is done with the last response
+	if (tResponse)
+	{
+		addPhase(PHASE_APP, tResponse);
+		tResponse = 0;
+	}
+
+	// keep the order of commands sent back to back
+	sendPending();
+
+	// remember which command was sent, a made-up response is superseded
+	cmd = data[1];
+	waiting = data[1] != CMD_RESET;
+	local = false;
+
+	// queue the packet until at least 20ms passed since last I2C transmission
+	memcpy(out, data, data[0] + 1);
+	pending = true;
+	tQueued = micros();
+	if (slotFree())
+		sendPending();
+}
+
 /**	Receives a packet from the SL018.
  *
  *	@param length the number of bytes to receive
- *	@return the number of bytes in the payload, or -1 if bad checksum
+ *	@param command the command the response must belong to
+ *	@param packet receives the packet, e.g. data, only if it is a valid response
+ *	@return the number of bytes in the payload, or 0 if no valid response to the command
  */
-byte SL018::receiveData(byte length)
+byte SL018::receiveData(byte length, byte command, byte* packet)
 {
-	// wait until at least 20ms passed since last I2C transmission
-	while(t > millis());
-	t = millis() + 20;
+	// wait until at least 20ms passed since last I2C transmission, the time
+	// since then, while the module processes the command, counts as slot time
+	waitForSlot();
+	addPhase(PHASE_SLOT, tBus);
+	unsigned long start = micros();
 
-	// read response
-	Wire.requestFrom(address, length);
+	// read response, count bytes on the bus including address byte
+	busBytes += Wire.requestFrom(address, length) + 1;
 	if(Wire.available())
 	{
+		// the destination is only written once the packet is valid
+		byte buffer[SIZE_PACKET];
+
 		// get length	of packet
 #if defined(ARDUINO) && ARDUINO >= 100
-		data[0] = Wire.read();
+		buffer[0] = Wire.read();
 #else
-		data[0] = Wire.receive();
+		buffer[0] = Wire.receive();
 #endif
 		
 		// get data
-		for (byte i = 1; i <= data[0]; i++)
+		for (byte i = 1; i <= buffer[0] && i < SIZE_PACKET; i++)
 		{
 #if defined(ARDUINO) && ARDUINO >= 100
-			data[i] = Wire.read();
+			buffer[i] = Wire.read();
 #else
-			data[i] = Wire.receive();
+			buffer[i] = Wire.receive();
 #endif
 		}
 
 		// show received packet for debugging
-		if (debug && data[0] > 0 )
+		if (debug && buffer[0] > 0 )
 		{
 			Serial.print("< ");
-			printArrayHex(data, data[0] + 1);
+			printArrayHex(buffer, min(buffer[0] + 1, SIZE_PACKET));
 			Serial.println();
 		}
 
-		// return with length of response
-		return data[0];
+		if (buffer[0] > 0 && buffer[0] < SIZE_PACKET)
+		{
+			tBus = micros();
+			addPhase(PHASE_READ, start);
+
+			// drop a response to another command, e.g. a late response to a
+			// superseded command
+			if (buffer[1] != command)
+			{
+				staleResponses++;
+				return 0;
+			}
+
+			// return with length of response
+			memcpy(packet, buffer, buffer[0] + 1);
+			responses++;
+			return buffer[0];
+		}
 	}
+	polls++;
+	tBus = micros();
+	addPhase(PHASE_POLL, start);
 	return 0;
 }
 
+/**	Print the phase times in Prometheus text format.
+ *
+ *	The phases are printed longest first, so the first line shows where
+ *	investing in bus speed, pacing or application changes pays off most.
+ */
+void SL018::printPhases()
+{
+	byte order[PHASES];
+	for (byte i = 0; i < PHASES; i++)
+	{
+		// insertion sort, longest first
+		byte j = i;
+		for (; j > 0 && phaseTime[order[j - 1]] < phaseTime[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (byte i = 0; i < PHASES; i++)
+	{
+		Serial.print("sl018_phase_microseconds_total{address=\"");
+		Serial.print(address);
+		Serial.print("\",phase=\"");
+		Serial.print(phaseName(order[i]));
+		Serial.print("\"} ");
+		Serial.println(phaseTime[order[i]]);
+	}
+}
+
+/**	Update the reliability counters for a response.
+ *
+ *	The counters tell a badly placed reader (many SEEK attempts per detection,
+ *	lost tags, slow first reads) from a bad tag (failures in one sector).
+ *	A tag is known to be present if it was selected before the failing command,
+ *	or, for SEEK and SELECT, if the TAG pin (pinDREADY) signals a tag.
+ */
+void SL018::countResult()
+{
+	switch (getCommand())
+	{
+	case CMD_SEEK:
+	case CMD_SELECT:
+		if (errorCode == OK)
+		{
+			detections++;
+			tDetect = millis();
+			readPending = true;
+		}
+		else if (errorCode == COLLISION)
+		{
+			collisions++;
+		}
+		break;
+
+	case CMD_LOGIN:
+		if (errorCode != LOGIN_OK)
+		{
+			authFailures++;
+			countSectorFailure(target);
+		}
+		break;
+
+	case CMD_READ16:
+	case CMD_READ4:
+		if (errorCode != OK)
+		{
+			readFailures++;
+			if (getCommand() == CMD_READ16)
+				countSectorFailure(blockSector(target));
+		}
+		else if (readPending)
+		{
+			// Time from detection to first read, buckets of 100ms, 200ms, 400ms, ...
+			unsigned long elapsed = millis() - tDetect;
+			byte bucket = 0;
+			while (bucket < FIRST_READ_BUCKETS - 1 && elapsed >= (100UL << bucket))
+				bucket++;
+			firstReads[bucket]++;
+			readPending = false;
+		}
+		break;
+	}
+
+	// A tag known to be present was not found: selected before, or signalled by the TAG pin
+	if (errorCode == NO_TAG)
+	{
+		boolean seek = getCommand() == CMD_SEEK || getCommand() == CMD_SELECT;
+		if ((!seek && sessionType) || (pinDREADY != 0xff && !digitalRead(pinDREADY)))
+			lostTags++;
+	}
+}
+
+/**	Count a failed authentication or read of a sector.
+ *
+ *	@param	sector	sector number, sectors from FAILURE_SECTORS up are not counted
+ */
+void SL018::countSectorFailure(byte sector)
+{
+	if (sector < FAILURE_SECTORS && sectorFailures[sector] < 255)
+		sectorFailures[sector]++;
+}
+
+/**	Print the reliability counters in Prometheus text format.
+ *
+ *	Sector failures are only printed for sectors that failed. The time to first
+ *	read is printed as a histogram with cumulative buckets.
+ */
+void SL018::printReliability()
+{
+	printMetric("selects", selects);
+	printMetric("detections", detections);
+	printMetric("lost_tags", lostTags);
+	printMetric("collisions", collisions);
+	printMetric("auth_failures", authFailures);
+	printMetric("read_failures", readFailures);
+	for (byte i = 0; i < FAILURE_SECTORS; i++)
+	{
+		if (sectorFailures[i])
+		{
+			Serial.print("sl018_sector_failures_total{address=\"");
+			Serial.print(address);
+			Serial.print("\",sector=\"");
+			Serial.print(i);
+			Serial.print("\"} ");
+			Serial.println(sectorFailures[i]);
+		}
+	}
+	unsigned long count = 0;
+	for (byte i = 0; i < FIRST_READ_BUCKETS; i++)
+	{
+		count += firstReads[i];
+		Serial.print("sl018_first_read_milliseconds_bucket{address=\"");
+		Serial.print(address);
+		Serial.print("\",le=\"");
+		if (i < FIRST_READ_BUCKETS - 1)
+			Serial.print(100UL << i);
+		else
+			Serial.print("+Inf");
+		Serial.print("\"} ");
+		Serial.println(count);
+	}
+}
+
+/**	Print a single counter in Prometheus text format.
+ *
+ *	@param	name	name of the counter, without prefix and suffix
+ *	@param	value	value of the counter
+ */
+void SL018::printMetric(const char* name, unsigned long value)
+{
+	Serial.print("sl018_");
+	Serial.print(name);
+	Serial.print("_total{address=\"");
+	Serial.print(address);
+	Serial.print("\"} ");
+	Serial.println(value);
+}
+
+/**	Maps phases to names.
+ *
+ *	@param	phase	PHASE_XX constant
+ *	@return	Name of the phase as null-terminated string
+ */
+const char* SL018::phaseName(byte phase)
+{
+	switch(phase)
+	{
+	case PHASE_SLOT: return "slot";
+	case PHASE_WRITE: return "write";
+	case PHASE_POLL: return "poll";
+	case PHASE_READ: return "read";
+	case PHASE_DECODE: return "decode";
+	case PHASE_APP: return "app";
+	default: return "";
+	}
+}
+
 /**	Maps tag types to names.
  *
  *	@param	type numeric tag type
@@ -15,6 +15,9 @@
 #endif
 
 #define SIZE_PACKET 19
+#define PHASES 6 // number of phases measured by getPhaseTime()
+#define FAILURE_SECTORS 16 // number of sectors with their own failure counter, see getSectorFailures()
+#define FIRST_READ_BUCKETS 8 // number of time-to-first-read histogram buckets, see getFirstReads()
 
 // Global functions
 void printArrayAscii(byte array[], byte len);
@@ -51,6 +54,11 @@ class SL018
 		static const byte	CMD_SLEEP				= 0x50;
 		static const byte	CMD_RESET				= 0xFF;
 
+		// Aliases for the command names of the SM130 library
+		static const byte CMD_SEEK_TAG		= CMD_SEEK;
+		static const byte CMD_SELECT_TAG	= CMD_SELECT;
+		static const byte CMD_AUTHENTICATE	= CMD_LOGIN;
+
 		static const byte	OK							= 0x00;
 		static const byte	NO_TAG					= 0x01;
 		static const byte	LOGIN_OK				= 0x02;
@@ -62,6 +70,14 @@ class SL018
 		static const byte	KEY_FAIL				= 0x0C;
 		static const byte	NO_LOGIN				= 0x0D;
 		static const byte	NO_VALUE				= 0x0E;
+		static const byte	UNSUPPORTED			= 0x7F; //!< not sent by the module, see routeCommand()
+
+		static const byte	PHASE_SLOT			= 0; //!< waiting for the pacing slot
+		static const byte	PHASE_WRITE			= 1; //!< I2C command transfer
+		static const byte	PHASE_POLL			= 2; //!< I2C polls while the module is processing
+		static const byte	PHASE_READ			= 3; //!< I2C response transfer
+		static const byte	PHASE_DECODE		= 4; //!< response processing in available()
+		static const byte	PHASE_APP				= 5; //!< application time from response to next command
 
 		boolean debug; //!< debug mode, prints all I2C communication to Serial port
 		byte address; //!< I2C address (default 0x50)
@@ -69,14 +85,46 @@ class SL018
 		byte pinDREADY; //!< DREADY pin (default -1)
 
 	private:
+		// Scheduling state first, checked by every available() call
+		byte cmd; //!< last sent command
+		boolean waiting; //!< true while a response is outstanding
+		boolean local; //!< true if a response was made up locally, see routeCommand()
+		boolean pending; //!< true while a command waits for its slot, see transmitData()
+		unsigned long t; //!< timer for sending I2C commands
 		byte data[SIZE_PACKET]; //!< packet data
+		byte out[SIZE_PACKET]; //!< command packet waiting for its slot
+		unsigned long tQueued; //!< time when the pending command was queued (us)
+		unsigned long tBus; //!< time when the last I2C transaction ended (us)
 		byte tagNumber[7]; //!< tag number as byte array
 		byte tagLength; //!< length of tag number in bytes (4 or 7)
 		char tagString[15]; //!< tag number as hex string
 		byte tagType; //!< type of tag
+		byte sessionType; //!< type of the selected tag, or 0 if none
 		char errorCode; //!< error code from some commands
-		byte cmd; //!< last sent command
-		unsigned long t; //!< timer for sending I2C commands
+		unsigned long idleTime; //!< time spent in idle sleep (us)
+		const byte* volatile tagList; //!< published list of tag numbers in RAM
+		unsigned int tagListCount; //!< number of tag numbers in tagList
+		const byte* volatile tagListInUse; //!< list being searched by isTagListed(), or 0
+		unsigned long commands; //!< number of commands transmitted
+		unsigned long responses; //!< number of response packets received
+		unsigned long polls; //!< number of polls that returned no response
+		unsigned long staleResponses; //!< number of dropped responses to another command than the last one
+		unsigned long busBytes; //!< number of bytes transferred over I2C, including address bytes
+		unsigned long phaseTime[PHASES]; //!< time spent per phase (us)
+		unsigned long tResponse; //!< time when the last response was returned, or 0
+		byte target; //!< sector, block or page of the last sent command
+		unsigned long selects; //!< number of SEEK and SELECT attempts
+		unsigned long detections; //!< number of SEEK and SELECT attempts that found a tag
+		unsigned long lostTags; //!< number of NO_TAG errors while a tag was known present
+		unsigned long collisions; //!< number of SELECT collisions
+		unsigned long authFailures; //!< number of failed authentications
+		unsigned long readFailures; //!< number of failed reads
+		byte sectorFailures[FAILURE_SECTORS]; //!< failed authentications and reads per sector, saturating at 255
+		unsigned int firstReads[FIRST_READ_BUCKETS]; //!< histogram of the time from detection to first read
+		unsigned long tDetect; //!< time when the selected tag was detected (ms)
+		boolean readPending; //!< true until the first read after a detection
+		byte ledState; //!< requested LED state
+		byte ledSent; //!< LED state last sent to the module, or 0xff if unknown
 
 	public:
 		//! Constructor
@@ -121,12 +169,84 @@ class SL018
 		//! Returns the tag type as a null-terminated string
 		const char* getTagName() { return tagName(tagType); };
 
+		//! Returns true if the tag number is found in a sorted list in program memory
+		boolean findTag(const byte* list, unsigned int count);
+
+		//! Returns true if the tag number is found in a sorted list in EEPROM
+		boolean findTagInEEPROM(int eeAddress, unsigned int count);
+
+		//! Publishes a sorted list of tag numbers in RAM, returns the previous list
+		const byte* setTagList(const byte* list, unsigned int count);
+
+		//! Returns true if the tag number is found in the published list
+		boolean isTagListed();
+
+		//! Returns true while isTagListed() is searching a list, e.g. one replaced by setTagList()
+		boolean isTagListInUse(const byte* list) { return list != 0 && tagListInUse == list; };
+
 		//! Returns the error code of the last executed command
 		char getErrorCode() { return errorCode; };
 
 		//! Returns a human-readable error message corresponding to the error code
 		const char* getErrorMessage();
 
+		//! Returns true if the last executed command succeeded
+		boolean isOK() { return errorCode == OK || errorCode == LOGIN_OK; };
+
+		//! Returns the time (in millis) at which the next I2C transaction may start
+		unsigned long getNextSlot() { return t; };
+
+		//! Returns the accumulated time spent in idle sleep (in micros, wraps around)
+		unsigned long getIdleTime() { return idleTime; };
+
+		//! Idles the MCU until the next interrupt if no reader event is due
+		void idle();
+
+		//! Returns the number of commands transmitted
+		unsigned long getCommandCount() { return commands; };
+
+		//! Returns the number of response packets received
+		unsigned long getResponseCount() { return responses; };
+
+		//! Returns the number of polls that returned no response
+		unsigned long getPollCount() { return polls; };
+
+		//! Returns the number of dropped responses to another command than the last one
+		unsigned long getStaleCount() { return staleResponses; };
+
+		//! Returns the number of bytes transferred over I2C, including address bytes
+		unsigned long getBusBytes() { return busBytes; };
+
+		//! Returns the accumulated time spent in a phase (PHASE_XX, in micros, wraps around)
+		unsigned long getPhaseTime(byte phase) { return phaseTime[phase]; };
+
+		//! Returns the number of SEEK and SELECT attempts
+		unsigned long getSelectCount() { return selects; };
+
+		//! Returns the number of SEEK and SELECT attempts that found a tag
+		unsigned long getDetectionCount() { return detections; };
+
+		//! Returns the number of NO_TAG errors while a tag was known present
+		unsigned long getLostTagCount() { return lostTags; };
+
+		//! Returns the number of SELECT collisions
+		unsigned long getCollisionCount() { return collisions; };
+
+		//! Returns the number of failed authentications
+		unsigned long getAuthFailures() { return authFailures; };
+
+		//! Returns the number of failed reads
+		unsigned long getReadFailures() { return readFailures; };
+
+		//! Returns the number of failed authentications and reads of a sector (0-15, saturates at 255)
+		byte getSectorFailures(byte sector) { return sectorFailures[sector]; };
+
+		//! Returns the number of first reads in a time-to-first-read bucket, see printStats()
+		unsigned int getFirstReads(byte bucket) { return firstReads[bucket]; };
+
+		//! Prints the transaction and reliability counters to Serial in Prometheus text format
+		void printStats();
+
 		//! Starts SEEK mode
 		void seekTag() { selectTag(); cmd = CMD_SEEK; };
 
@@ -134,7 +254,7 @@ class SL018
 		void selectTag() { sendCommand(CMD_SELECT); };
 
 		//! Sends a HALT_TAG command
-		void haltTag() { cmd = CMD_IDLE; };
+		void haltTag() { cmd = CMD_IDLE; waiting = false; sessionType = 0; local = false; pending = false; };
 		
 		//! Sends a SLEEP command (can only wake-up with hardware reset!)
 		void sleep() { sendCommand(CMD_SLEEP); };
@@ -151,6 +271,12 @@ class SL018
 		//! Authenticate a sector using the specified key
 		void authenticate(byte sector, byte keyType, byte key[6]);
 
+		//! Authenticate the sector of a block using the transport key
+		void authenticateBlock(byte block) { authenticate(blockSector(block)); };
+
+		//! Authenticate the sector of a block using the specified key
+		void authenticateBlock(byte block, byte keyType, byte key[6]) { authenticate(blockSector(block), keyType, key); };
+
 		//! Reads a 16-byte block
 		void readBlock(byte block);
 
@@ -160,16 +286,52 @@ class SL018
 		//! Write master key (key A)
 		void writeKey(byte sector, byte key[6]);
 
-		//! LED control (SL018 only)
+		//! LED control (SL018 only), sent in a free slot between tag commands
 		void led(boolean on);
 
 	private:    
 		//! Send single-byte command
 		void sendCommand(byte cmd);
-		//! Transmit command packet over I2C
+		//! Returns true if the next I2C transaction may start
+		boolean slotFree() { return (long)(millis() - t) >= 0; };
+		//! Returns true if an output command may be sent now: in a free slot with no tag command outstanding, or before a SELECT retry of a seek
+		boolean outputFree() { return slotFree() && (pending ? cmd == CMD_SEEK : !waiting); };
+		//! Answers a command locally if the selected tag type does not support it
+		boolean routeCommand(byte command);
+		//! Make up a response to a command that is not sent to the module
+		void localResponse(byte command, byte status);
+		//! Send pending output changes, returns true if the slot was used
+		boolean flushOutput();
+		//! Wait for the next I2C slot and reserve the one after it
+		void waitForSlot();
+		//! Send the command waiting for its slot, waits for the slot if needed
+		void sendPending();
+		//! Put the MCU in idle sleep until the next interrupt
+		void sleepMCU();
+		//! Binary search for the tag number in a sorted list
+		boolean searchTag(const byte* list, unsigned int count, int (*compare)(const void*, const void*, size_t));
+		//! Queue command packet, sent over I2C in the next free slot
 		void transmitData();
-		//! Receive response packet over I2C
-		byte receiveData(byte length);
+		//! Write a packet over I2C
+		void writePacket(const byte* packet);
+		//! Receive response packet to a command over I2C
+		byte receiveData(byte length, byte command, byte* packet);
+		//! Add the time since start to a phase
+		void addPhase(byte phase, unsigned long start) { phaseTime[phase] += micros() - start; };
+		//! Print a single counter in Prometheus text format
+		void printMetric(const char* name, unsigned long value);
+		//! Print the phase times in Prometheus text format, longest first
+		void printPhases();
+		//! Update the reliability counters for a response
+		void countResult();
+		//! Count a failed authentication or read of a block's sector
+		void countSectorFailure(byte sector);
+		//! Print the reliability counters in Prometheus text format
+		void printReliability();
+		//! Returns the name of a phase
+		const char* phaseName(byte phase);
+		//! Returns the sector of a block, Mifare 4K sectors from 32 up have 16 blocks
+		static byte blockSector(byte block) { return block < 128 ? block >> 2 : 32 + ((block - 128) >> 4); };
 		//! Returns human-readable tag name corresponding to tag type
 		const char* tagName(byte type);
 };
@@ -30,8 +30,11 @@ void loop()
 {
   // start seek mode
   rfid.seekTag();
-  // wait until tag detected
-  while(!rfid.available());
+  // wait until tag detected, idle the MCU in between polls
+  while(!rfid.available())
+  {
+    rfid.idle();
+  }
   // print tag id
   Serial.println(rfid.getTagString());
 }
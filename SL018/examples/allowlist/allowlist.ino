@@ -0,0 +1,371 @@
+/**
+ *  @title:  StrongLink SL018/SL030 offline allowlist with delta updates
+ *  @see:    http://www.stronglink.cn/english/sl018.htm
+ *  @see:    http://www.stronglink.cn/english/sl030.htm
+ *
+ *  Decides on tags locally, using a sorted list of allowed tag numbers in
+ *  EEPROM, looked up by binary search with findTagInEEPROM().
+ *  The list is versioned, and updated with batches of changes (deltas)
+ *  instead of sending the full list. EEPROM holds two banks: the active one
+ *  is used for lookups, while a delta is merged with it into the other one,
+ *  one entry per loop(), so tags keep being processed during an update.
+ *  The new bank only becomes active when its header is written with the new
+ *  version, so a power failure during an update leaves the old list intact.
+ *  Only 4-byte tag numbers are listed, 7-byte tags are always denied.
+ *
+ *  Commands, one per line, each answered with OK or ERR <reason>:
+ *  V<version>  start a delta to version, e.g. V42 (must be newer)
+ *  +<tag>      add a tag number, e.g. +04A1B2C3
+ *  -<tag>      remove a tag number
+ *  E           end the delta, and start merging it
+ *  ?           print version and number of tags (VERSION <version> <count>)
+ *  Tags in a delta must be in ascending order. When the merge is done,
+ *  "VERSION <version> <count> <ms>" is printed.
+ *
+ *  Arduino to SL018/SL030 wiring:
+ *  A4/SDA     2     3
+ *  A5/SCL     3     4
+ *  5V         4     -
+ *  GND        5     6
+ *  3V3        -     1
+ */
+
+#include <Wire.h>
+#include <SL018.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+// EEPROM banks: a header followed by sorted 4-byte tag numbers
+#define BANK_SIZE 512
+#define HEADER_SIZE sizeof(Header)
+#define TAG_SIZE 4
+#define MAX_TAGS ((BANK_SIZE - HEADER_SIZE) / TAG_SIZE)
+
+// Maximum number of changes in one delta
+#define DELTA_SIZE 32
+
+// Ignore the same tag for this long (ms) while it stays in the field
+#define REPEAT_TIME 1000
+
+// Bank header
+struct Header
+{
+  unsigned long version; // list version
+  unsigned int count; // number of tag numbers
+  byte crc; // CRC-8 of all preceding bytes
+};
+
+SL018 rfid;
+
+// Active bank
+byte active;
+Header header;
+
+// Delta being received or merged: operation ('+' or '-') and tag number
+byte deltaOp[DELTA_SIZE];
+byte deltaTag[DELTA_SIZE][TAG_SIZE];
+byte deltaCount;
+unsigned long deltaVersion;
+boolean receiving;
+
+// Merge state: next entry of the active bank, next change, tags written
+boolean merging;
+unsigned int src, dst;
+byte change;
+unsigned long mergeStart;
+
+// Serial command line
+char line[16];
+byte lineLength;
+
+// Last tag seen, to ignore repeated detections
+byte lastTag[7];
+unsigned long lastTime;
+
+void setup()
+{
+  Wire.begin();
+  Serial.begin(57600);
+  loadBanks();
+  printVersion();
+  Serial.println();
+  rfid.seekTag();
+}
+
+void loop()
+{
+  // Process tags
+  if(rfid.available())
+  {
+    if(rfid.getTagLength())
+    {
+      checkTag();
+    }
+    rfid.seekTag();
+  }
+
+  // Merge one entry of a pending delta
+  if(merging)
+  {
+    mergeStep();
+  }
+
+  // Read commands
+  while(Serial.available())
+  {
+    char c = Serial.read();
+    if(c == '\n' || c == '\r')
+    {
+      line[lineLength] = 0;
+      if(lineLength)
+      {
+        command();
+      }
+      lineLength = 0;
+    }
+    else if(lineLength < sizeof(line) - 1)
+    {
+      line[lineLength++] = c;
+    }
+  }
+}
+
+// Look up a detected tag in the active bank
+void checkTag()
+{
+  byte* tag = rfid.getTagNumber();
+  byte len = rfid.getTagLength();
+
+  // Ignore the same tag while it stays in the field
+  if(memcmp(tag, lastTag, len) == 0 && millis() - lastTime < REPEAT_TIME)
+  {
+    lastTime = millis();
+    return;
+  }
+  memset(lastTag, 0, sizeof(lastTag));
+  memcpy(lastTag, tag, len);
+  lastTime = millis();
+
+  boolean allowed = len == TAG_SIZE
+    && rfid.findTagInEEPROM(bankAddress(active) + HEADER_SIZE, header.count);
+  Serial.print(allowed ? "ALLOW " : "DENY ");
+  Serial.println(rfid.getTagString());
+}
+
+// Handle a command line
+void command()
+{
+  switch(line[0])
+  {
+  case 'V':
+    if(merging)
+    {
+      Serial.println("ERR busy");
+      return;
+    }
+    deltaVersion = strtoul(line + 1, 0, 10);
+    if(deltaVersion <= header.version)
+    {
+      Serial.println("ERR version");
+      return;
+    }
+    deltaCount = 0;
+    receiving = true;
+    break;
+
+  case '+':
+  case '-':
+    if(!receiving)
+    {
+      Serial.println("ERR no delta");
+      return;
+    }
+    if(deltaCount == DELTA_SIZE)
+    {
+      Serial.println("ERR delta full");
+      return;
+    }
+    if(!parseTag(line + 1, deltaTag[deltaCount]))
+    {
+      Serial.println("ERR tag");
+      return;
+    }
+    if(deltaCount && memcmp(deltaTag[deltaCount], deltaTag[deltaCount - 1], TAG_SIZE) <= 0)
+    {
+      Serial.println("ERR order");
+      return;
+    }
+    deltaOp[deltaCount++] = line[0];
+    break;
+
+  case 'E':
+    if(!receiving)
+    {
+      Serial.println("ERR no delta");
+      return;
+    }
+    receiving = false;
+    startMerge();
+    break;
+
+  case '?':
+    printVersion();
+    Serial.println();
+    return;
+
+  default:
+    Serial.println("ERR command");
+    return;
+  }
+  Serial.println("OK");
+}
+
+// Start merging the delta with the active bank into the other bank
+void startMerge()
+{
+  src = dst = 0;
+  change = 0;
+  mergeStart = millis();
+  merging = true;
+
+  // Invalidate the target bank first, its entries are about to change
+  eeprom_update_byte((byte*)bankAddress(!active) + offsetof(Header, crc),
+    eeprom_read_byte((byte*)bankAddress(!active) + offsetof(Header, crc)) ^ 0xff);
+}
+
+// Write one entry of the merged list, the smaller of the next active entry
+// and the next change
+void mergeStep()
+{
+  byte entry[TAG_SIZE];
+  byte* next = 0;
+  int diff = 1;
+
+  if(src < header.count)
+  {
+    eeprom_read_block(entry, (const void*)(bankAddress(active) + HEADER_SIZE + src * TAG_SIZE), TAG_SIZE);
+    diff = change < deltaCount ? memcmp(deltaTag[change], entry, TAG_SIZE) : 1;
+  }
+  else if(change >= deltaCount)
+  {
+    commitMerge();
+    return;
+  }
+  else
+  {
+    diff = -1;
+  }
+
+  if(diff <= 0 && change < deltaCount)
+  {
+    // A change comes first, or replaces an equal entry
+    if(deltaOp[change] == '+')
+    {
+      next = deltaTag[change];
+    }
+    if(diff == 0)
+    {
+      src++;
+    }
+    change++;
+  }
+  else
+  {
+    next = entry;
+    src++;
+  }
+
+  if(next)
+  {
+    if(dst == MAX_TAGS)
+    {
+      merging = false;
+      Serial.println("ERR list full");
+      return;
+    }
+    eeprom_update_block(next, (void*)(bankAddress(!active) + HEADER_SIZE + dst * TAG_SIZE), TAG_SIZE);
+    dst++;
+  }
+}
+
+// Write the header of the merged bank, which makes it the active one
+void commitMerge()
+{
+  header.version = deltaVersion;
+  header.count = dst;
+  header.crc = headerCrc(&header);
+  eeprom_update_block(&header, (void*)bankAddress(!active), sizeof(Header));
+  active = !active;
+  merging = false;
+  printVersion();
+  Serial.print(' ');
+  Serial.println(millis() - mergeStart);
+}
+
+// Select the valid bank with the newest version
+void loadBanks()
+{
+  Header h[2];
+  boolean valid[2];
+  for(byte i = 0; i < 2; i++)
+  {
+    eeprom_read_block(&h[i], (const void*)bankAddress(i), sizeof(Header));
+    valid[i] = h[i].crc == headerCrc(&h[i]) && h[i].count <= MAX_TAGS;
+  }
+  active = valid[1] && (!valid[0] || h[1].version > h[0].version);
+  if(valid[active])
+  {
+    header = h[active];
+  }
+  else
+  {
+    // Empty list, version 0
+    memset(&header, 0, sizeof(header));
+  }
+}
+
+// CRC-8 of a header, excluding the CRC itself
+byte headerCrc(void* h)
+{
+  byte crc = 0;
+  for(byte i = 0; i < offsetof(Header, crc); i++)
+  {
+    crc = _crc_ibutton_update(crc, ((byte*)h)[i]);
+  }
+  return crc;
+}
+
+// EEPROM address of a bank
+int bankAddress(byte bank)
+{
+  return bank * BANK_SIZE;
+}
+
+// Parse a 4-byte tag number in hex
+boolean parseTag(const char* s, byte* tag)
+{
+  if(strlen(s) != TAG_SIZE * 2)
+  {
+    return false;
+  }
+  for(byte i = 0; i < TAG_SIZE * 2; i++)
+  {
+    char c = s[i];
+    byte nibble;
+    if(c >= '0' && c <= '9') nibble = c - '0';
+    else if(c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+    else if(c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+    else return false;
+    tag[i / 2] = (tag[i / 2] << 4) | nibble;
+  }
+  return true;
+}
+
+// Print version and number of tags of the active bank
+void printVersion()
+{
+  Serial.print("VERSION ");
+  Serial.print(header.version);
+  Serial.print(' ');
+  Serial.print(header.count);
+}
@@ -0,0 +1,215 @@
+/**
+ *  @title:  StrongLink SL018/SL030 multi-head card encoder
+ *  @see:    http://www.stronglink.cn/english/sl018.htm
+ *  @see:    http://www.stronglink.cn/english/sl030.htm
+ *
+ *  Encodes cards on several readers in parallel. Jobs are taken from a
+ *  queue, and each reader (head) runs its own select, login, write and
+ *  verify sequence. All heads are serviced from one loop without waiting
+ *  for any of them: a command is queued by the library, and sent by
+ *  available() when the head's next I2C slot is due, so their I2C
+ *  transactions interleave on the bus.
+ *  Every step still takes at least 40ms per head, one slot for the command
+ *  and one for its response, so a card takes at least 160ms whatever the
+ *  number of heads. Throughput grows with the number of heads as long as
+ *  the bus has room: a step keeps a 100kHz bus busy for 2-4ms, so beyond
+ *  about 10 heads the bus, not the pacing, is the limit.
+ *  A failed job is put back in the queue for another card. A head that
+ *  fails MAX_FAILURES times in a row is disabled, the others keep going.
+ *  The loop scans a small array with the next I2C slot of each head, and
+ *  only touches a reader object when its slot is due.
+ *
+ *  Arduino to SL018/SL030 wiring:
+ *  A4/SDA     2     3
+ *  A5/SCL     3     4
+ *  5V         4     -
+ *  GND        5     6
+ *  3V3        -     1
+ *  5,4,3,2    1     5 // TAG pins of the heads
+ */
+
+#include <Wire.h>
+#include <SL018.h>
+
+// Number of heads, add more addresses and pins to the tables below
+#define HEADS 4
+
+// Block to write, and consecutive failures before a head is disabled
+#define BLOCK 4
+#define MAX_FAILURES 3
+
+// Size of the queue of jobs to retry, with at least HEADS entries no job is lost
+#define RETRIES 8
+
+// Head states
+#define WAIT_CARD 0
+#define SELECT 1
+#define LOGIN 2
+#define WRITE 3
+#define VERIFY 4
+#define REMOVE_CARD 5
+#define DISABLED 6
+
+//make sure these addresses and TAG pins match your reader configuration
+byte address[HEADS] = { 0x50, 0x52, 0x54, 0x56 };
+byte tagPin[HEADS] = { 5, 4, 3, 2 };
+
+SL018 rfid[HEADS];
+
+// Per-head state, scanned every pass
+byte state[HEADS];
+unsigned long nextSlot[HEADS];
+
+// Per-head job data
+unsigned int job[HEADS];
+byte failures[HEADS];
+char image[HEADS][16];
+
+// Job queue: failed jobs first, then new ones
+unsigned int nextJob = 1;
+unsigned int retry[RETRIES];
+byte retries = 0;
+unsigned int completed = 0;
+
+void setup()
+{
+  for(byte i = 0; i < HEADS; i++)
+  {
+    rfid[i].address = address[i];
+    pinMode(tagPin[i], INPUT);
+  }
+  Wire.begin();
+  Serial.begin(57600);
+  Serial.println("Multi-head encoder, place cards on the readers");
+}
+
+void loop()
+{
+  unsigned long now = millis();
+  for(byte i = 0; i < HEADS; i++)
+  {
+    switch(state[i])
+    {
+    case WAIT_CARD:
+      if(!digitalRead(tagPin[i]))
+      {
+        startJob(i);
+      }
+      break;
+    case REMOVE_CARD:
+      if(digitalRead(tagPin[i]))
+      {
+        state[i] = WAIT_CARD;
+      }
+      break;
+    case DISABLED:
+      break;
+    default:
+      // only poll the reader when its next I2C slot is due, this also sends
+      // a queued command
+      if((long)(now - nextSlot[i]) >= 0)
+      {
+        if(rfid[i].available())
+        {
+          nextStep(i);
+        }
+        nextSlot[i] = rfid[i].getNextSlot();
+      }
+    }
+  }
+}
+
+// Take the next job from the queue, and start encoding it on a head
+void startJob(byte i)
+{
+  job[i] = retries > 0 ? retry[--retries] : nextJob++;
+
+  // card image: job number, padded with zeroes
+  memset(image[i], 0, sizeof(image[i]));
+  snprintf(image[i], sizeof(image[i]), "CARD %05u", job[i]);
+
+  rfid[i].selectTag();
+  nextSlot[i] = rfid[i].getNextSlot();
+  state[i] = SELECT;
+}
+
+// Handle a response, and send the next command of the job
+void nextStep(byte i)
+{
+  if(!rfid[i].isOK())
+  {
+    failJob(i, rfid[i].getErrorMessage());
+    return;
+  }
+  switch(state[i])
+  {
+  case SELECT:
+    rfid[i].authenticateBlock(BLOCK);
+    state[i] = LOGIN;
+    break;
+  case LOGIN:
+    rfid[i].writeBlock(BLOCK, image[i]);
+    state[i] = WRITE;
+    break;
+  case WRITE:
+    rfid[i].readBlock(BLOCK);
+    state[i] = VERIFY;
+    break;
+  case VERIFY:
+    if(memcmp(rfid[i].getBlock(), image[i], sizeof(image[i])) != 0)
+    {
+      failJob(i, "Verification failed");
+      return;
+    }
+    // job done, wait for the card to be removed
+    completed++;
+    failures[i] = 0;
+    rfid[i].haltTag();
+    state[i] = REMOVE_CARD;
+    Serial.print("Head ");
+    Serial.print(i + 1);
+    Serial.print(" encoded job ");
+    Serial.print(job[i]);
+    Serial.print(", ");
+    Serial.print(completed);
+    Serial.print(" cards in ");
+    Serial.print(millis() / 1000);
+    Serial.println("s");
+    break;
+  }
+}
+
+// Put a failed job back in the queue, and disable the head if it keeps failing
+void failJob(byte i, const char* reason)
+{
+  Serial.print("Head ");
+  Serial.print(i + 1);
+  Serial.print(" failed job ");
+  Serial.print(job[i]);
+  Serial.print(": ");
+  Serial.println(reason);
+
+  if(retries < RETRIES)
+  {
+    retry[retries++] = job[i];
+  }
+  else
+  {
+    Serial.print("Head ");
+    Serial.print(i + 1);
+    Serial.print(" lost job ");
+    Serial.println(job[i]);
+  }
+  rfid[i].haltTag();
+  if(++failures[i] >= MAX_FAILURES)
+  {
+    Serial.print("Head ");
+    Serial.print(i + 1);
+    Serial.println(" disabled");
+    state[i] = DISABLED;
+  }
+  else
+  {
+    state[i] = REMOVE_CARD;
+  }
+}
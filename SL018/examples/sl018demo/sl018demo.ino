@@ -83,6 +83,7 @@ void loop()
       Serial.println("S - Seek tag");
       Serial.println("R - Read sector");
       Serial.println("W - Write string");
+      Serial.println("T - Statistics");
       Serial.println("Q - Sleep");
       Serial.println("X - Reset");
       break;
@@ -133,6 +134,11 @@ void loop()
         rfid.selectTag();
       }
       break;
+    case 't':
+    case 'T':
+      // print transaction counters
+      rfid.printStats();
+      break;
     case 'q':
     case 'Q':
       // enter sleep mode
@@ -155,7 +161,28 @@ void loop()
     // check for errors
     if(rfid.getErrorCode() != SL018::OK && rfid.getErrorCode() != SL018::LOGIN_OK)
     {
-      if(action != SEEK) // ignore errors while in SEEK mode
+      if(action == READ && rfid.getErrorCode() == SL018::UNSUPPORTED)
+      {
+        // the tag type has no Mifare blocks (e.g. Pro, ProX, DESFire), end the read
+        Serial.println(rfid.getErrorMessage());
+        rfid.haltTag();
+        action = NONE;
+      }
+      else if(action == READ && rfid.getCommand() != SL018::CMD_SELECT)
+      {
+        // record the failed blocks in the dump (the whole sector if login failed),
+        // and continue with the next block, which needs a new select after a failure
+        if(skipBlocks(rfid.getCommand() == SL018::CMD_LOGIN ? 4 - (block & 0x03) : 1))
+        {
+          rfid.selectTag();
+        }
+        else
+        {
+          rfid.haltTag();
+          action = NONE;
+        }
+      }
+      else if(action != SEEK) // ignore errors while in SEEK mode
       {
         Serial.println(rfid.getErrorMessage());
         rfid.haltTag();
@@ -170,10 +197,15 @@ void loop()
       case SL018::CMD_SELECT:
         // store tag type
         tagType = rfid.getTagType();
-        // show tag name and serial number
-        Serial.print(rfid.getTagName());
-        Serial.print(' ');
-        Serial.println(rfid.getTagString());
+        // show tag name, serial number and time, unless reselected during a read
+        if(action != READ || block == 0)
+        {
+          Serial.print(rfid.getTagName());
+          Serial.print(' ');
+          Serial.print(rfid.getTagString());
+          Serial.print(" at ");
+          Serial.println(millis());
+        }
         // in case of read or write action, authenticate first
         if(action == READ || action == WRITE)
         {
@@ -277,6 +309,22 @@ void loop()
   }
 }
 
+// Print the error message for blocks that could not be read, and skip them
+// Returns true if there are blocks left to read
+boolean skipBlocks(byte n)
+{
+  while(n-- && numBlocks)
+  {
+    Serial.print("Block ");
+    printHex(block);
+    Serial.print(": ");
+    Serial.println(rfid.getErrorMessage());
+    ++block;
+    --numBlocks;
+  }
+  return numBlocks > 0;
+}
+
 int readQuotedString(char *s, int len)
 {
   int i = 0;
@@ -18,21 +18,31 @@
 #include <Wire.h>
 #include <SL018.h>
 
-//pins to listen for the RFID board signalling that it has detected a tag
-int reader1OutPin = 5;
-int reader2OutPin = 4;
-const char* tagString;
+// Number of readers, add more addresses and pins to the tables below
+#define READERS 2
 
-SL018 rfid1;
-SL018 rfid2;
+// Wait this long (ms) before querying a reader's tag again
+#define HOLD_TIME 1500
+
+//pins to listen for the RFID boards signalling that they have detected a tag
+byte tagPin[READERS] = { 5, 4 };
+
+//make sure these addresses match your reader configuration
+byte address[READERS] = { 0x50, 0x52 };
+
+SL018 rfid[READERS];
+
+// per-reader state: waiting for a SEEK response, and time until which to ignore the reader
+boolean seeking[READERS];
+unsigned long holdUntil[READERS];
 
 void setup()
 {
-  //make sure these two addresses match your reader configuration
-  rfid1.address = 0x50;
-  rfid2.address = 0x52;
-  pinMode(reader1OutPin, INPUT);
-  pinMode(reader2OutPin, INPUT);
+  for(byte i = 0; i < READERS; i++)
+  {
+    rfid[i].address = address[i];
+    pinMode(tagPin[i], INPUT);
+  }
   Wire.begin();
   Serial.begin(57600);
 
@@ -42,42 +52,35 @@ void setup()
 
 void loop()
 {
-  //if the board has signalled that it found a tag
-  if(!digitalRead(reader1OutPin)) 
-  {
-    //query tag data
-	rfid1.seekTag();
-	
-	/* for some reason the loop defined as:
-    while(!digitalRead(reader1OutPin) || !rfid1.available());
-	does not work so we need a workaround:*/
-    
-	//while we are waiting for data
-	while(!rfid1.available()) {
-	  //break if the tag has been removed
-      if (digitalRead(reader1OutPin)) {
-        break;
-      };
-    };
-    tagString = rfid1.getTagString();
-    Serial.print("Reader 1 found: ");
-    Serial.println(tagString);
-	//wait a while before querying the tag again
-    delay(1500);
-  };
-  
-  //"in parallel" we wait for the other reader
-  if(!digitalRead(reader2OutPin)) 
+  // service all readers without blocking on any of them, so a slow or
+  // absent tag on one reader never delays the others
+  for(byte i = 0; i < READERS; i++)
   {
-    rfid2.seekTag();
-    while(!rfid2.available()) {
-      if (digitalRead(reader2OutPin)) {
-        break;
-      };
-    };
-    tagString = rfid2.getTagString();
-    Serial.print("Reader 2 found: ");
-    Serial.println(tagString);
-    delay(1500);  
-  };
-}
\ No newline at end of file
+    if(seeking[i])
+    {
+      if(rfid[i].available())
+      {
+        Serial.print("Reader ");
+        Serial.print(i + 1);
+        Serial.print(" found: ");
+        Serial.println(rfid[i].getTagString());
+        //wait a while before querying the tag again
+        seeking[i] = false;
+        holdUntil[i] = millis() + HOLD_TIME;
+      }
+      else if(digitalRead(tagPin[i]))
+      {
+        //the tag has been removed, stop waiting for it
+        rfid[i].haltTag();
+        seeking[i] = false;
+      }
+    }
+    //if the board has signalled that it found a tag
+    else if(!digitalRead(tagPin[i]) && (long)(millis() - holdUntil[i]) >= 0)
+    {
+      //query tag data
+      rfid[i].seekTag();
+      seeking[i] = true;
+    }
+  }
+}
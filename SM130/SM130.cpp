@@ -24,6 +24,33 @@
 
 #include "SM130.h"
 
+#if defined(__AVR__)
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#else
+// interrupts are always enabled after the block, the previous state is not restored
+#define ATOMIC_BLOCK(type) for (byte once = (noInterrupts(), 1); once; once = 0, interrupts())
+#endif
+
+#if defined(__AVR__)
+// memcmp() for a second operand in EEPROM, used by findTagInEEPROM()
+static int memcmp_E(const void* s1, const void* s2, size_t n)
+{
+	const byte* p = (const byte*)s1;
+	const byte* e = (const byte*)s2;
+	for (; n; n--, p++, e++)
+	{
+		byte b = eeprom_read_byte(e);
+		if (*p != b)
+			return *p < b ? -1 : 1;
+	}
+	return 0;
+}
+#endif
+
 // local functions
 void arrayToHex(char *s, byte array[], byte len);
 char toHex(byte b);
@@ -42,6 +69,27 @@ SM130::SM130()
 	pinDREADY = 4;
 	debug = false;
 	t = millis() + 10;
+	idleTime = 0;
+	tagList = 0;
+	tagListCount = 0;
+	tagListInUse = 0;
+	commands = responses = polls = busBytes = 0;
+	memset(phaseTime, 0, sizeof(phaseTime));
+	tResponse = 0;
+	tBus = 0;
+	selects = detections = lostTags = 0;
+	authFailures = readFailures = 0;
+	memset(sectorFailures, 0, sizeof(sectorFailures));
+	memset(firstReads, 0, sizeof(firstReads));
+	readPending = false;
+	checksumErrors = staleResponses = 0;
+	waiting = portRequest = false;
+	portOut = portSent = portIn = 0xff;
+	portWaiting = false;
+	tPort = 0;
+	sessionType = 0;
+	local = false;
+	pending = false;
 }
 
 /* Public member functions ****************************************************/
@@ -51,7 +99,11 @@ SM130::SM130()
  *
  * 	This function should be called in setup(). It initializes the IO pins and
  *	issues a hardware or software reset, depending on the definition of pinRESET.
- *	After reset, a HALT_TAG command is issued to terminate the automatic SEEK mode.
+ *	After reset, a HALT_TAG command is issued to terminate the automatic SEEK mode,
+ *	unless seek is true. In that case the module keeps seeking from power-up,
+ *	and the first tag it finds is returned by available() as a SEEK_TAG
+ *	response, which saves a SEEK_TAG command and the time to restart the seek.
+ *	Antenna power is not set then, as the antenna is already on after reset.
  *
  *	Wire.begin() should also be called in setup(), and Wire.h should be included.
  *
@@ -59,8 +111,10 @@ SM130::SM130()
  *	If pinDREADY has the value 0xff (-1), the SM130 will be polled over I2C while
  *	in SEEK mode, otherwise the DREADY pin will be polled in SEEK mode.
  *	For other commands, response polling is always over I2C.
+ *
+ *	@param	seek	true to leave automatic SEEK mode running
  */
-void SM130::reset()
+void SM130::reset(boolean seek)
 {
 	// Init DREADY pin
 	if (pinDREADY != 0xff)
@@ -79,11 +133,25 @@ void SM130::reset()
 	else // software reset
 	{
 		sendCommand(CMD_RESET);
+		sendPending();
 	}
 
 	// Allow enough time for reset
 	delay(200);
 
+	// Output port state is unknown after reset
+	portSent = 0xff;
+	portWaiting = false;
+
+	if (seek)
+	{
+		// Wait for the tag found by automatic seek mode, the antenna is on
+		antennaPower = 1;
+		cmd = CMD_SEEK_TAG;
+		waiting = true;
+		return;
+	}
+
 	// Set antenna power
 	setAntennaPower(1);
 
@@ -92,6 +160,11 @@ void SM130::reset()
 }
 
 /**	Get the firmware version string.
+ *
+ *	If the version is not known yet, a VERSION command is sent, and its
+ *	response is polled in the following slots for up to 1s.
+ *
+ *	@return	the firmware version, or 0 if the module did not respond
  */
 const char* SM130::getFirmwareVersion()
 {
@@ -99,27 +172,112 @@ const char* SM130::getFirmwareVersion()
 	if (*versionString != 0)
 		return versionString;
 
-	// else send VERSION command and retry a few times if no response
-	for (byte n = 0; n < 10; n++)
+	// else send VERSION command and poll for the response
+	sendCommand(CMD_VERSION);
+	unsigned long start = millis();
+	while (millis() - start < 1000)
 	{
-		sendCommand(CMD_VERSION);
 		if (available() && getCommand() == CMD_VERSION)
 			return versionString;
-		delay(100);
+		idle();
 	}
 	// time-out after 1s
 	return 0;
 }
 
+/**	Load the persisted state from EEPROM.
+ *
+ *	The state holds what would otherwise be queried from the module after
+ *	every reboot. Currently that is the firmware version, so that
+ *	getFirmwareVersion() returns immediately without a VERSION command.
+ *	The state is only loaded if it was saved for the current I2C address.
+ *
+ *	@param	eeAddress	EEPROM address of the state, as passed to saveState()
+ *	@return	true if a valid state was found and loaded
+ */
+boolean SM130::loadState(int eeAddress)
+{
+	State state;
+	if (readState(eeAddress, &state) < 0 || state.address != address)
+		return false;
+	memcpy(versionString, state.versionString, sizeof(versionString));
+	return true;
+}
+
+/**	Save the persisted state to EEPROM.
+ *
+ *	Nothing is written if the state is unchanged or the version is not known,
+ *	so this may be called whenever convenient, e.g. after every
+ *	getFirmwareVersion().
+ *	Otherwise the state is written to the slot after the newest one, so writes
+ *	are spread over STATE_SLOTS slots. A write interrupted by a power failure
+ *	leaves the previous state intact.
+ *	The state takes STATE_SLOTS * 11 bytes of EEPROM, starting at eeAddress.
+ *
+ *	@param	eeAddress	EEPROM address of the state
+ */
+void SM130::saveState(int eeAddress)
+{
+#if defined(__AVR__)
+	// Nothing to save while the version is unknown, e.g. after a time-out
+	if (*versionString == 0)
+		return;
+
+	State state;
+	int slot = readState(eeAddress, &state);
+
+	// Lazy write-back: skip if unchanged
+	if (slot >= 0 && state.address == address
+		&& memcmp(state.versionString, versionString, sizeof(versionString)) == 0)
+		return;
+
+	// Write to the next slot in sequence
+	state.seq = slot >= 0 ? state.seq + 1 : 0;
+	state.address = address;
+	memcpy(state.versionString, versionString, sizeof(versionString));
+	state.crc = 0;
+	for (byte i = 0; i < sizeof(State) - 1; i++)
+		state.crc = _crc_ibutton_update(state.crc, ((byte*)&state)[i]);
+	slot = (slot + 1) % STATE_SLOTS;
+	eeprom_update_block(&state, (void*)(eeAddress + slot * sizeof(State)), sizeof(State));
+#else
+	(void)eeAddress;
+#endif
+}
+
 /**	Checks for availability of a valid response packet.
  *
  *	This function should always be called and return true prior to using results
  *	of a command.
  *
+ *	It never waits for the pacing slot: until the next I2C slot is reached,
+ *	it returns false without touching the bus, so it can be polled from
+ *	loop() without blocking other work. A command waiting for its slot is
+ *	sent from here, see transmitData().
+ *
  *	@returns	true if a valid response packet is available
  */
 boolean SM130::available()
 {
+	// Send pending output changes in a free slot between tag commands: when no
+	// tag command is outstanding, or during a seek, which is sent again after
+	if (outputFree() && flushOutput())
+	{
+		return false;
+	}
+
+	// Send a queued command in its slot, its response is polled in the next one
+	if (pending)
+	{
+		if (slotFree())
+			sendPending();
+		return false;
+	}
+
+	// Nothing to poll while no response is outstanding
+	if (!waiting)
+		return false;
+
 	// If in SEEK mode and using DREADY pin, check the status
 	if (cmd == CMD_SEEK_TAG && pinDREADY != 0xff)
 	{
@@ -127,6 +285,10 @@ boolean SM130::available()
 			return false;
 	}
 
+	// Poll the module only in a free slot, instead of waiting for it
+	if (!local && !slotFree())
+		return false;
+
 	// Set the maximum length of the expected response packet
 	byte len;
 	switch(cmd)
@@ -138,12 +300,15 @@ boolean SM130::available()
 	case CMD_WRITE_KEY:
 	case CMD_HALT_TAG:
 	case CMD_SLEEP:
+	case CMD_READ_PORT:
+	case CMD_WRITE_PORT:
 		len = 4;
 		break;
 	case CMD_WRITE4:
 	case CMD_WRITE_VALUE:
 	case CMD_READ_VALUE:
 		len = 8;
+		break;
 	case CMD_SEEK_TAG:
 	case CMD_SELECT_TAG:
 		len = 11;
@@ -152,15 +317,23 @@ boolean SM130::available()
 		len = SIZE_PACKET;
 	}
 
-	// If valid data received, process the response packet
-	if (receiveData(len) > 0)
+	// If valid data received, or a response was made up, process the response packet
+	if (local || receiveData(len, cmd, data) > 0)
 	{
+		unsigned long start = micros();
+
 		// Init response variables
 		tagType = tagLength = *tagString = 0;
 
 		// If packet length is 2, the command failed. Set error code.
 		errorCode = getPacketLength() < 3 ? data[2] : 0;
 
+		// Update the reliability counters, unless the response was made up
+		if (local)
+			local = false;
+		else
+			countResult();
+
 		// Process command response
 		switch (getCommand())
 		{
@@ -175,10 +348,12 @@ boolean SM130::available()
 		case CMD_SEEK_TAG:
 		case CMD_SELECT_TAG:
 			// If no error, get tag number
+			// The tag type determines which commands are sent, see routeCommand()
+			sessionType = 0;
 			if(errorCode == 0 && getPacketLength() >= 6)
 			{
 				tagLength = getPacketLength() - 2;
-				tagType = data[2];
+				tagType = sessionType = data[2];
 				memcpy(tagNumber, data + 3, tagLength);
 				arrayToHex(tagString, tagNumber, tagLength);
 			}
@@ -194,6 +369,10 @@ boolean SM130::available()
 		case CMD_WRITE4:
 			break;
 
+		case CMD_HALT_TAG:
+			sessionType = 0;
+			break;
+
 		case CMD_ANTENNA_POWER:
 			errorCode = 0;
 			antennaPower = data[2];
@@ -204,13 +383,112 @@ boolean SM130::available()
 			return false;
 		}
 
+		// The response is complete, unless a seek is still in progress
+		waiting = getCommand() == CMD_SEEK_TAG && errorCode == 'L';
+
 		// Data available
+		addPhase(PHASE_DECODE, start);
+		tResponse = micros();
 		return true;
 	}
 	// No data available
 	return false;
 }
 
+/**	Look up the tag number in a sorted list of tag numbers.
+ *
+ *	The list is stored in program memory (PROGMEM) as packed tag numbers in
+ *	ascending byte order, each with the length of the current tag number
+ *	(4 or 7 bytes), so separate lists are needed for each length.
+ *	A binary search is used, the list is not copied to RAM.
+ *	Only valid right after available() returned a SEEK or SELECT response.
+ *
+ *	@param	list	pointer to the list in program memory
+ *	@param	count	number of tag numbers in the list
+ *	@return	true if the tag number is in the list
+ */
+boolean SM130::findTag(const byte* list, unsigned int count)
+{
+#if defined(__AVR__)
+	return searchTag(list, count, memcmp_P);
+#else
+	// program memory is addressed like RAM, memcmp_P() may be a function-like macro here
+	return searchTag(list, count, memcmp);
+#endif
+}
+
+/**	Look up the tag number in a sorted list of tag numbers in EEPROM.
+ *
+ *	The list has the same format as for findTag(). A binary search is used,
+ *	reading only the entries it compares, so a lookup in a list of n tag
+ *	numbers reads about log2(n) entries. Only implemented on AVR, other
+ *	architectures return false.
+ *
+ *	@param	eeAddress	EEPROM address of the list
+ *	@param	count	number of tag numbers in the list
+ *	@return	true if the tag number is in the list
+ */
+boolean SM130::findTagInEEPROM(int eeAddress, unsigned int count)
+{
+#if defined(__AVR__)
+	return searchTag((const byte*)eeAddress, count, memcmp_E);
+#else
+	(void)eeAddress;
+	(void)count;
+	return false;
+#endif
+}
+
+/**	Publish a list of tag numbers in RAM for isTagListed().
+ *
+ *	The list has the same format as for findTag(), and may be replaced at any
+ *	time without locking out lookups: the list pointer and count are swapped
+ *	with interrupts disabled, and a lookup takes a snapshot of both before
+ *	searching. On AVR the list may also be replaced from an interrupt handler.
+ *	Other architectures always enable interrupts again after the swap, so
+ *	there it must only be replaced from loop().
+ *	The previous list is returned. Its buffer can be reused for the next
+ *	update as soon as isTagListInUse() returns false for it, no new lookup
+ *	starts on it. When lookups and updates are both done from loop(), that
+ *	is immediately.
+ *
+ *	@param	list	pointer to the new list, or 0 for an empty list
+ *	@param	count	number of tag numbers in the list
+ *	@return	pointer to the previous list
+ */
+const byte* SM130::setTagList(const byte* list, unsigned int count)
+{
+	const byte* old;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		old = tagList;
+		tagList = list;
+		tagListCount = count;
+	}
+	return old;
+}
+
+/**	Look up the tag number in the list published by setTagList().
+ *
+ *	Only valid right after available() returned a SEEK or SELECT response.
+ *
+ *	@return	true if the tag number is in the list
+ */
+boolean SM130::isTagListed()
+{
+	const byte* list;
+	unsigned int count;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		list = tagList;
+		count = tagListCount;
+		tagListInUse = list;
+	}
+	boolean found = list != 0 && searchTag(list, count, memcmp);
+	tagListInUse = 0;
+	return found;
+}
+
 /**	Get error message for last command.
  *
  *	@return	Human-readable error message as a null-terminated string
@@ -241,6 +519,8 @@ const char* SM130::getErrorMessage()
 		return "Block is read-protected";
 	case 'E':
 		return "Invalid key format in EEPROM";
+	case UNSUPPORTED:
+		return "Not supported by tag type";
 	default:
 		return "Unknown error";
 	}
@@ -260,11 +540,16 @@ void SM130::setAntennaPower(byte level)
 }
 
 /** Authenticate with transport key (0xFFFFFFFFFFFF).
+ *
+ *	For a Mifare Ultralight, 'L' (login successful) is returned without sending
+ *	a command.
  *
  *	@param block Block number
  */
 void SM130::authenticate(byte block)
 {
+	if (routeCommand(CMD_AUTHENTICATE))
+		return;
 	data[0] = 3;
 	data[1] = CMD_AUTHENTICATE;
 	data[2] = block;
@@ -280,6 +565,8 @@ void SM130::authenticate(byte block)
  */
 void SM130::authenticate(byte block, byte keyType, byte key[6])
 {
+	if (routeCommand(CMD_AUTHENTICATE))
+		return;
 	data[0] = 9;
 	data[1] = CMD_AUTHENTICATE;
 	data[2] = block;
@@ -294,6 +581,8 @@ void SM130::authenticate(byte block, byte keyType, byte key[6])
  */
 void SM130::readBlock(byte block)
 {
+	if (routeCommand(CMD_READ16))
+		return;
 	data[0] = 2;
 	data[1] = CMD_READ16;
 	data[2] = block;
@@ -310,6 +599,8 @@ void SM130::readBlock(byte block)
  */
 void SM130::writeBlock(byte block, const char* message)
 {
+	if (routeCommand(CMD_WRITE16))
+		return;
 	data[0] = 18;
 	data[1] = CMD_WRITE16;
 	data[2] = block;
@@ -327,6 +618,8 @@ void SM130::writeBlock(byte block, const char* message)
  */
 void SM130::writeFourByteBlock(byte block, const char* message)
 {
+	if (routeCommand(CMD_WRITE4))
+		return;
 	data[0] = 6;
 	data[1] = CMD_WRITE4;
 	data[2] = block;
@@ -335,6 +628,99 @@ void SM130::writeFourByteBlock(byte block, const char* message)
 	transmitData();
 }
 
+/**	Idle the MCU while no reader event is due.
+ *
+ *	Puts the MCU in idle sleep until the next interrupt, unless a response can
+ *	be polled right now. The millis() timer interrupt wakes the MCU at least
+ *	every millisecond, so this function may be called from loop() whenever
+ *	available() returns false, instead of busy polling.
+ *	Time spent sleeping is accumulated, see getIdleTime().
+ */
+void SM130::idle()
+{
+	// Nothing is due if no command, response or output is pending, if the next
+	// slot is ahead, or if DREADY is low in SEEK mode and no output is pending
+	boolean output = portWaiting || portOut != portSent || portRequest;
+	if ((!waiting && !pending && !output) || !slotFree()
+		|| (!output && cmd == CMD_SEEK_TAG && pinDREADY != 0xff && !digitalRead(pinDREADY)))
+	{
+		sleepMCU();
+	}
+}
+
+/**	Print the transaction and reliability counters.
+ *
+ *	The counters are printed to Serial in Prometheus/OpenMetrics text format,
+ *	labeled with the I2C address of the reader, e.g.
+ *	<code>sm130_commands_total{address="66"} 1234</code>
+ *	Idle and phase times are in microseconds, and wrap around like micros().
+ *	The phases split the time of each transaction, see getPhaseTime().
+ */
+void SM130::printStats()
+{
+	printMetric("commands", commands);
+	printMetric("responses", responses);
+	printMetric("polls", polls);
+	printMetric("checksum_errors", checksumErrors);
+	printMetric("stale_responses", staleResponses);
+	printMetric("bus_bytes", busBytes);
+	printMetric("idle_microseconds", idleTime);
+	printPhases();
+	printReliability();
+}
+
+/**	Set the output port.
+ *
+ *	Bit 0 controls OUT1, bit 1 controls OUT2.
+ *	The value is cached, and only sent to the module when it changes.
+ *	To not interfere with tag commands, it is only sent right away when no
+ *	tag command is outstanding and the slot is free. Otherwise available()
+ *	sends it in a free slot after the response has been received.
+ *	During a seek, which may last until a tag arrives, it is sent in the next
+ *	free slot. As any command cancels the seek, SEEK_TAG is sent again in the
+ *	slot after it, and available() may return another "seek in progress"
+ *	response.
+ *	The response to the WRITE_PORT command is not polled, the next tag command
+ *	drops it as stale. The response to the last tag command is left intact.
+ *
+ *	@param value Output port value
+ */
+void SM130::writePort(byte value)
+{
+	portOut = value;
+	if (outputFree())
+	{
+		flushOutput();
+	}
+}
+
+/**	Check the cached input port value, and request a new one if too old.
+ *
+ *	A READ_PORT command is sent in the same way as a writePort() change.
+ *	Its response is polled by available() in the next slot, which updates the
+ *	cached value returned by getPort(). During a seek, SEEK_TAG is sent
+ *	again after that poll. A tag command sent before the poll drops the
+ *	response, and readPort() requests a new one when called again.
+ *
+ *	@param maxAge Maximum age of the cached value in ms
+ *	@return	true if the cached value is at most maxAge ms old
+ */
+boolean SM130::readPort(unsigned int maxAge)
+{
+	if (portIn != 0xff && millis() - tPort <= maxAge)
+	{
+		return true;
+	}
+	// request a new value, unless one is already outstanding
+	if (!portWaiting)
+		portRequest = true;
+	if (outputFree())
+	{
+		flushOutput();
+	}
+	return false;
+}
+
 /**	Send 1-byte command.
  *
  *	@param cmd Command
@@ -349,31 +735,166 @@ void SM130::sendCommand(byte cmd)
 /* Private member functions ****************************************************/
 
 
-/**	Transmit a packet with checksum to the SM130.
+/**	Route a command by the type of the selected tag.
+ *
+ *	The tag type is known from the last SEEK_TAG or SELECT_TAG response.
+ *	A Mifare Ultralight has no sectors to authenticate, so authentication
+ *	succeeds locally. Commands that cannot succeed on the selected tag are
+ *	answered locally with error code UNSUPPORTED, instead of a failing
+ *	transaction and a reselect: 4-byte writes on Mifare Classic, and all
+ *	memory commands on other tag types.
+ *
+ *	@param	command	the command to route
+ *	@return	true if the command was answered locally and must not be sent
  */
-void SM130::transmitData()
+boolean SM130::routeCommand(byte command)
 {
-	// wait until at least 20ms passed since last I2C transmission
-	while(t > millis());
-	t = millis() + 20;
+	switch (sessionType)
+	{
+	case 0:
+		// No tag selected, let the module report the error
+		return false;
+	case MIFARE_ULTRALIGHT:
+		if (command != CMD_AUTHENTICATE)
+			return false;
+		localResponse(command, 'L');
+		return true;
+	case MIFARE_1K:
+	case MIFARE_4K:
+		if (command != CMD_WRITE4)
+			return false;
+	}
+	localResponse(command, UNSUPPORTED);
+	return true;
+}
+
+/**	Make up a response to a command that is not sent to the module.
+ *
+ *	The response is returned by the next call of available().
+ *
+ *	@param	command	the command to respond to
+ *	@param	status	error code of the response
+ */
+void SM130::localResponse(byte command, char status)
+{
+	data[0] = 2;
+	data[1] = command;
+	data[2] = status;
+	cmd = command;
+	waiting = true;
+	local = true;
+}
+
+/**	Send pending output changes one command at a time, or poll the input
+ *	port.
+ *
+ *	Port commands use their own packet buffer, so the response to the last
+ *	tag command stays valid. The response to WRITE_PORT is not polled, which
+ *	would cost another slot, but dropped as stale by the next tag command.
+ *	The response to READ_PORT is polled once, in the next slot.
+ *	Must only be called when outputFree() is true.
+ *
+ *	@return	true if the slot was used
+ */
+boolean SM130::flushOutput()
+{
+	if (portWaiting)
+	{
+		byte packet[SIZE_PACKET];
+		if (receiveData(4, CMD_READ_PORT, packet))
+		{
+			portIn = packet[2];
+			tPort = millis();
+		}
+		portWaiting = false;
+		resumeSeek();
+		return true;
+	}
+	if (portOut != portSent)
+	{
+		byte packet[] = { 2, CMD_WRITE_PORT, portOut };
+		portSent = portOut;
+		waitForSlot();
+		writePacket(packet);
+		resumeSeek();
+		return true;
+	}
+	if (portRequest)
+	{
+		byte packet[] = { 1, CMD_READ_PORT };
+		portRequest = false;
+		portWaiting = true;
+		waitForSlot();
+		writePacket(packet);
+		return true;
+	}
+	return false;
+}
 
+/**	Queue SEEK_TAG again after a port command cancelled a seek.
+ *
+ *	The seek is sent in the next free slot, like any queued command. Its
+ *	response is still expected, so the application sees the seek go on.
+ */
+void SM130::resumeSeek()
+{
+	if (!waiting || cmd != CMD_SEEK_TAG)
+		return;
+
+	out[0] = 1;
+	out[1] = CMD_SEEK_TAG;
+	pending = true;
+	tQueued = micros();
+}
+
+/**	Send the command waiting for its slot, with checksum.
+ *
+ *	Waits for the slot if it has not been reached yet, which only happens
+ *	when a command is sent before available() got the chance to send the
+ *	previous one, e.g. during reset().
+ */
+void SM130::sendPending()
+{
+	if (!pending)
+		return;
+
+	waitForSlot();
+	addPhase(PHASE_SLOT, tQueued);
+	pending = false;
+
+	// a late READ_PORT response is dropped as stale by this command
+	portWaiting = false;
+	target = out[2];
+	writePacket(out);
+}
+
+/**	Write a packet with checksum to the SM130.
+ *
+ *	@param	packet	length byte, command and parameters, without checksum
+ */
+void SM130::writePacket(const byte* packet)
+{
 	// init checksum and packet length
 	byte sum = 0;
-	byte len = data[0] + 1;
+	byte len = packet[0] + 1;
 
-	// remember which command was sent
-	cmd = data[1];
+	// count command and bytes on the bus, including address and checksum bytes
+	commands++;
+	if (packet[1] == CMD_SEEK_TAG || packet[1] == CMD_SELECT_TAG)
+		selects++;
+	busBytes += len + 2;
 
 	// transmit packet with checksum
+	unsigned long start = micros();
 	Wire.beginTransmission(address);
 	for (int i = 0; i < len; i++)
 	{
 #if defined(ARDUINO) && ARDUINO >= 100
-		Wire.write(data[i]);
+		Wire.write(packet[i]);
 #else
-		Wire.send(data[i]);
+		Wire.send(packet[i]);
 #endif
-		sum += data[i];
+		sum += packet[i];
 	}
 #if defined(ARDUINO) && ARDUINO >= 100
 	Wire.write(sum);
@@ -381,68 +902,395 @@ void SM130::transmitData()
 	Wire.send(sum);
 #endif
 	Wire.endTransmission();
+	tBus = micros();
+	addPhase(PHASE_WRITE, start);
 
 	// show transmitted packet for debugging
 	if (debug)
 	{
 		Serial.print("> ");
-		printArrayHex(data, len);
+		printArrayHex((byte*)packet, len);
 		Serial.print(' ');
 		printHex(sum);
 		Serial.println();
 	}
 }
 
+/**	Wait until the next I2C slot has been reached.
+ *
+ *	The MCU is put in idle sleep while waiting. The slot after this one is
+ *	reserved 20ms ahead.
+ */
+void SM130::waitForSlot()
+{
+	while (!slotFree())
+	{
+		sleepMCU();
+	}
+	t = millis() + 20;
+}
+
+/**	Binary search for the tag number in a sorted list.
+ *
+ *	@param	list	pointer to the list
+ *	@param	count	number of tag numbers in the list
+ *	@param	compare	memcmp() for a list in RAM, or memcmp_P() for a list in program memory
+ *	@return	true if the tag number is in the list
+ */
+boolean SM130::searchTag(const byte* list, unsigned int count, int (*compare)(const void*, const void*, size_t))
+{
+	unsigned int lo = 0, hi = count;
+	while (tagLength && lo < hi)
+	{
+		unsigned int mid = lo + (hi - lo) / 2;
+		int diff = compare(tagNumber, list + mid * tagLength, tagLength);
+		if (diff == 0)
+			return true;
+		if (diff < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return false;
+}
+
+/**	Put the MCU in idle sleep until the next interrupt.
+ *
+ *	Only implemented on AVR, other architectures return immediately.
+ */
+void SM130::sleepMCU()
+{
+#if defined(__AVR__)
+	unsigned long start = micros();
+	set_sleep_mode(SLEEP_MODE_IDLE);
+	sleep_mode();
+	idleTime += micros() - start;
+#endif
+}
+
+/**	Transmit a packet with checksum to the SM130.
+ *
+ *	The packet is sent right away if the slot is free. Otherwise it is
+ *	queued, and sent by available() once the slot is reached, so sending a
+ *	command never waits for the pacing. A command that is still queued when
+ *	the next one is sent goes out first, in its slot.
+ */
+void SM130::transmitData()
+{
+	// the application is done with the last response
+	if (tResponse)
+	{
+		addPhase(PHASE_APP, tResponse);
+		tResponse = 0;
+	}
+
+	// keep the order of commands sent back to back
+	sendPending();
+
+	// remember which command was sent, a made-up response is superseded
+	cmd = data[1];
+	waiting = true;
+	local = false;
+
+	// queue the packet until at least 20ms passed since last I2C transmission
+	memcpy(out, data, data[0] + 1);
+	pending = true;
+	tQueued = micros();
+	if (slotFree())
+		sendPending();
+}
+
 /**	Receives a packet from the SM130 and verifies the checksum.
  *
  *	@param length the number of bytes to receive
- *	@return the number of bytes in the payload, or -1 if bad checksum
+ *	@param command the command the response must belong to
+ *	@param packet receives the packet, e.g. data, only if it is a valid response
+ *	@return the number of bytes in the payload, or 0 if no valid response to the command
  */
-byte SM130::receiveData(byte length)
+byte SM130::receiveData(byte length, byte command, byte* packet)
 {
-	// wait until at least 20ms passed since last I2C transmission
-	while(t > millis());
-	t = millis() + 20;
+	// wait until at least 20ms passed since last I2C transmission, the time
+	// since then, while the module processes the command, counts as slot time
+	waitForSlot();
+	addPhase(PHASE_SLOT, tBus);
+	unsigned long start = micros();
 
-	// read response
+	// read response, count bytes on the bus including address byte
 	Wire.requestFrom(address, length);
 	byte n = Wire.available();
+	busBytes += n + 1;
 
-	// get data if available
+	// get data if available, the destination is only written once the packet is valid
 	if(n > 0)
 	{
+		byte buffer[SIZE_PACKET];
 		for (byte i = 0; i < n;)
 		{
 #if defined(ARDUINO) && ARDUINO >= 100
-			data[i++] = Wire.read();
+			buffer[i++] = Wire.read();
 #else
-			data[i++] = Wire.receive();
+			buffer[i++] = Wire.receive();
 #endif
 		}
 
 		// show received packet for debugging
-		if (debug && data[0] > 0 )
+		if (debug && buffer[0] > 0 )
 		{
 			Serial.print("< ");
-			printArrayHex(data, n);
+			printArrayHex(buffer, n);
 			Serial.println();
 		}
 
-		// verify checksum if length > 0 and <= SIZE_PAYLOAD
-		if (data[0] > 0 && data[0] <= SIZE_PAYLOAD)
+		// verify packet if length > 0 and <= SIZE_PAYLOAD
+		if (buffer[0] > 0 && buffer[0] <= SIZE_PAYLOAD)
 		{
+			tBus = micros();
+			addPhase(PHASE_READ, start);
+
+			// drop a packet longer than the bytes read, e.g. a longer response
+			// to another command, or a response to another command, e.g. a late
+			// response to a superseded command, or the version the module sends
+			// after a software reset, when reset(true) expects a SEEK_TAG response
+			if (buffer[0] + 2 > n
+				|| (buffer[1] != command && !(command == CMD_RESET && buffer[1] == CMD_VERSION)))
+			{
+				staleResponses++;
+				return 0;
+			}
+
+			// drop a packet with an invalid checksum
 			byte i, sum;
-			for (i = 0, sum = 0; i <= data[0]; i++)
+			for (i = 0, sum = 0; i <= buffer[0]; i++)
 			{
-				sum += data[i];
+				sum += buffer[i];
 			}
-			// return with length of response, or -1 if invalid checksum
-			return sum == data[i] ? data[0] : -1;
+			if (sum != buffer[i])
+			{
+				checksumErrors++;
+				return 0;
+			}
+
+			// return with length of response, including checksum
+			memcpy(packet, buffer, buffer[0] + 2);
+			responses++;
+			return buffer[0];
 		}
 	}
+	polls++;
+	tBus = micros();
+	addPhase(PHASE_POLL, start);
 	return 0;
 }
 
+/**	Read the newest valid state slot from EEPROM.
+ *
+ *	The newest slot is a valid slot that is not followed by a valid slot
+ *	with the next sequence number.
+ *
+ *	@param	eeAddress	EEPROM address of the state
+ *	@param	state	receives the newest state
+ *	@return	slot number of the newest state, or -1 if no valid state found
+ */
+int SM130::readState(int eeAddress, State* state)
+{
+	int newest = -1;
+#if defined(__AVR__)
+	State slots[STATE_SLOTS];
+	boolean valid[STATE_SLOTS];
+	byte i;
+
+	// Read all slots and verify their checksums
+	eeprom_read_block(slots, (const void*)eeAddress, sizeof(slots));
+	for (i = 0; i < STATE_SLOTS; i++)
+	{
+		byte crc = 0;
+		for (byte j = 0; j < sizeof(State) - 1; j++)
+			crc = _crc_ibutton_update(crc, ((byte*)&slots[i])[j]);
+		valid[i] = crc == slots[i].crc;
+	}
+
+	// Find the end of the sequence
+	for (i = 0; i < STATE_SLOTS; i++)
+	{
+		byte next = (i + 1) % STATE_SLOTS;
+		if (valid[i] && (!valid[next] || slots[next].seq != (byte)(slots[i].seq + 1)))
+		{
+			newest = i;
+			*state = slots[i];
+			break;
+		}
+	}
+#else
+	(void)eeAddress;
+	(void)state;
+#endif
+	return newest;
+}
+
+/**	Print the phase times in Prometheus text format.
+ *
+ *	The phases are printed longest first, so the first line shows where
+ *	investing in bus speed, pacing or application changes pays off most.
+ */
+void SM130::printPhases()
+{
+	byte order[PHASES];
+	for (byte i = 0; i < PHASES; i++)
+	{
+		// insertion sort, longest first
+		byte j = i;
+		for (; j > 0 && phaseTime[order[j - 1]] < phaseTime[i]; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	for (byte i = 0; i < PHASES; i++)
+	{
+		Serial.print("sm130_phase_microseconds_total{address=\"");
+		Serial.print(address);
+		Serial.print("\",phase=\"");
+		Serial.print(phaseName(order[i]));
+		Serial.print("\"} ");
+		Serial.println(phaseTime[order[i]]);
+	}
+}
+
+/**	Update the reliability counters for a response.
+ *
+ *	The counters tell a badly placed reader (many SEEK attempts per detection,
+ *	lost tags, slow first reads) from a bad tag (failures in one sector).
+ *	A tag is known to be present if it was selected before the failing command.
+ */
+void SM130::countResult()
+{
+	switch (getCommand())
+	{
+	case CMD_SEEK_TAG:
+	case CMD_SELECT_TAG:
+		if (errorCode == 0)
+		{
+			detections++;
+			tDetect = millis();
+			readPending = true;
+		}
+		break;
+
+	case CMD_AUTHENTICATE:
+		if (errorCode != 'L')
+		{
+			authFailures++;
+			countSectorFailure(blockSector(target));
+		}
+		break;
+
+	case CMD_READ16:
+		if (errorCode != 0)
+		{
+			readFailures++;
+			countSectorFailure(blockSector(target));
+		}
+		else if (readPending)
+		{
+			// Time from detection to first read, buckets of 100ms, 200ms, 400ms, ...
+			unsigned long elapsed = millis() - tDetect;
+			byte bucket = 0;
+			while (bucket < FIRST_READ_BUCKETS - 1 && elapsed >= (100UL << bucket))
+				bucket++;
+			firstReads[bucket]++;
+			readPending = false;
+		}
+		break;
+	}
+
+	// A tag that was selected before the failing command is gone
+	if (errorCode == 'N' && sessionType
+		&& getCommand() != CMD_SEEK_TAG && getCommand() != CMD_SELECT_TAG)
+		lostTags++;
+}
+
+/**	Count a failed authentication or read of a sector.
+ *
+ *	@param	sector	sector number, sectors from FAILURE_SECTORS up are not counted
+ */
+void SM130::countSectorFailure(byte sector)
+{
+	if (sector < FAILURE_SECTORS && sectorFailures[sector] < 255)
+		sectorFailures[sector]++;
+}
+
+/**	Print the reliability counters in Prometheus text format.
+ *
+ *	Sector failures are only printed for sectors that failed. The time to first
+ *	read is printed as a histogram with cumulative buckets.
+ */
+void SM130::printReliability()
+{
+	printMetric("selects", selects);
+	printMetric("detections", detections);
+	printMetric("lost_tags", lostTags);
+	printMetric("auth_failures", authFailures);
+	printMetric("read_failures", readFailures);
+	for (byte i = 0; i < FAILURE_SECTORS; i++)
+	{
+		if (sectorFailures[i])
+		{
+			Serial.print("sm130_sector_failures_total{address=\"");
+			Serial.print(address);
+			Serial.print("\",sector=\"");
+			Serial.print(i);
+			Serial.print("\"} ");
+			Serial.println(sectorFailures[i]);
+		}
+	}
+	unsigned long count = 0;
+	for (byte i = 0; i < FIRST_READ_BUCKETS; i++)
+	{
+		count += firstReads[i];
+		Serial.print("sm130_first_read_milliseconds_bucket{address=\"");
+		Serial.print(address);
+		Serial.print("\",le=\"");
+		if (i < FIRST_READ_BUCKETS - 1)
+			Serial.print(100UL << i);
+		else
+			Serial.print("+Inf");
+		Serial.print("\"} ");
+		Serial.println(count);
+	}
+}
+
+/**	Print a single counter in Prometheus text format.
+ *
+ *	@param	name	name of the counter, without prefix and suffix
+ *	@param	value	value of the counter
+ */
+void SM130::printMetric(const char* name, unsigned long value)
+{
+	Serial.print("sm130_");
+	Serial.print(name);
+	Serial.print("_total{address=\"");
+	Serial.print(address);
+	Serial.print("\"} ");
+	Serial.println(value);
+}
+
+/**	Maps phases to names.
+ *
+ *	@param	phase	PHASE_XX constant
+ *	@return	Name of the phase as null-terminated string
+ */
+const char* SM130::phaseName(byte phase)
+{
+	switch(phase)
+	{
+	case PHASE_SLOT: return "slot";
+	case PHASE_WRITE: return "write";
+	case PHASE_POLL: return "poll";
+	case PHASE_READ: return "read";
+	case PHASE_DECODE: return "decode";
+	case PHASE_APP: return "app";
+	default: return "";
+	}
+}
+
 /**	Maps tag types to names.
  *
  *	@param	type numeric tag type
@@ -17,6 +17,11 @@
 #define SIZE_PAYLOAD 18 // maximum payload size of I2C packet
 #define SIZE_PACKET (SIZE_PAYLOAD + 2) // total I2C packet size, including length byte and checksum
 
+#define STATE_SLOTS 4 // number of EEPROM slots used by saveState() for wear levelling
+#define PHASES 6 // number of phases measured by getPhaseTime()
+#define FAILURE_SECTORS 16 // number of sectors with their own failure counter, see getSectorFailures()
+#define FIRST_READ_BUCKETS 8 // number of time-to-first-read histogram buckets, see getFirstReads()
+
 #define halt haltTag // deprecated function halt() renamed to haltTag()
 
 // Global functions
@@ -31,16 +36,61 @@ void printHex(byte val);
  */
 class SM130
 {
+	// Scheduling state first, checked by every available() call
+	byte cmd; //!< last sent command
+	boolean waiting; //!< true while a response is outstanding
+	boolean local; //!< true if a response was made up locally, see routeCommand()
+	boolean pending; //!< true while a command waits for its slot, see transmitData()
+	unsigned long t; //!< timer for sending I2C commands
 	byte data[SIZE_PACKET]; //!< packet data
+	byte out[SIZE_PACKET]; //!< command packet waiting for its slot, without checksum
+	unsigned long tQueued; //!< time when the pending command was queued (us)
+	unsigned long tBus; //!< time when the last I2C transaction ended (us)
 	char versionString[8]; //!< version string
 	byte tagNumber[7]; //!< tag number as byte array
 	byte tagLength; //!< length of tag number in bytes (4 or 7)
 	char tagString[15]; //!< tag number as hex string
 	byte tagType; //!< type of tag
+	byte sessionType; //!< type of the selected tag, or 0 if none
 	char errorCode; //!< error code from some commands
 	byte antennaPower; //!< antenna power level
-	byte cmd; //!< last sent command
-	unsigned long t; //!< timer for sending I2C commands
+	unsigned long idleTime; //!< time spent in idle sleep (us)
+	const byte* volatile tagList; //!< published list of tag numbers in RAM
+	unsigned int tagListCount; //!< number of tag numbers in tagList
+	const byte* volatile tagListInUse; //!< list being searched by isTagListed(), or 0
+	unsigned long commands; //!< number of commands transmitted
+	unsigned long responses; //!< number of response packets received
+	unsigned long polls; //!< number of polls that returned no response
+	unsigned long staleResponses; //!< number of dropped responses to another command than the last one
+	unsigned long checksumErrors; //!< number of responses with a bad checksum
+	unsigned long busBytes; //!< number of bytes transferred over I2C, including address bytes
+	unsigned long phaseTime[PHASES]; //!< time spent per phase (us)
+	unsigned long tResponse; //!< time when the last response was returned, or 0
+	byte target; //!< sector, block or page of the last sent command
+	unsigned long selects; //!< number of SEEK and SELECT attempts
+	unsigned long detections; //!< number of SEEK and SELECT attempts that found a tag
+	unsigned long lostTags; //!< number of NO_TAG errors while a tag was known present
+	unsigned long authFailures; //!< number of failed authentications
+	unsigned long readFailures; //!< number of failed reads
+	byte sectorFailures[FAILURE_SECTORS]; //!< failed authentications and reads per sector, saturating at 255
+	unsigned int firstReads[FIRST_READ_BUCKETS]; //!< histogram of the time from detection to first read
+	unsigned long tDetect; //!< time when the selected tag was detected (ms)
+	boolean readPending; //!< true until the first read after a detection
+	byte portOut; //!< requested output port value
+	byte portSent; //!< output port value last sent to the module, or 0xff if unknown
+	byte portIn; //!< cached input port value
+	boolean portRequest; //!< true if the input port should be read
+	boolean portWaiting; //!< true while the response to a READ_PORT command is outstanding
+	unsigned long tPort; //!< time when the input port was last read
+
+	//! Persisted state, see saveState()
+	struct State
+	{
+		byte seq; //!< sequence number, the newest slot is the last in sequence
+		byte address; //!< I2C address of the module this state belongs to
+		char versionString[8]; //!< firmware version
+		byte crc; //!< CRC-8 of all preceding bytes
+	};
 
 public:
 	static const int VERSION = 1;  //!< version of this library
@@ -69,6 +119,15 @@ public:
 	static const byte CMD_SET_BAUD = 0x94;
 	static const byte CMD_SLEEP = 0x96;
 
+	static const char UNSUPPORTED = 'T'; //!< error code not sent by the module, see routeCommand()
+
+	static const byte PHASE_SLOT = 0; //!< waiting for the pacing slot
+	static const byte PHASE_WRITE = 1; //!< I2C command transfer
+	static const byte PHASE_POLL = 2; //!< I2C polls while the module is processing
+	static const byte PHASE_READ = 3; //!< I2C response transfer
+	static const byte PHASE_DECODE = 4; //!< response processing in available()
+	static const byte PHASE_APP = 5; //!< application time from response to next command
+
 	boolean debug; //!< debug mode, prints all I2C communication to Serial port
 	byte address; //!< I2C address (default 0x42)
 	byte pinRESET; //!< RESET pin (default 3)
@@ -76,10 +135,14 @@ public:
 
 	//! Constructor
 	SM130();
-	//! Hardware or software reset of the SM130 module
-	void reset();
+	//! Hardware or software reset of the SM130 module, optionally leaving automatic SEEK mode running
+	void reset(boolean seek = false);
 	//! Returns a null-terminated string with the firmware version of the SM130 module
 	const char* getFirmwareVersion();
+	//! Loads the persisted state from EEPROM, returns true if found
+	boolean loadState(int eeAddress);
+	//! Saves the persisted state to EEPROM, if it has changed
+	void saveState(int eeAddress);
 	//! Returns true if a response packet is available
 	boolean available();
 	//! Returns a pointer to the response packet
@@ -106,10 +169,58 @@ public:
 	byte getTagType() { return tagType; };
 	//! Returns the tag type as a null-terminated string
 	const char* getTagName() { return tagName(tagType); };
+	//! Returns true if the tag number is found in a sorted list in program memory
+	boolean findTag(const byte* list, unsigned int count);
+	//! Returns true if the tag number is found in a sorted list in EEPROM
+	boolean findTagInEEPROM(int eeAddress, unsigned int count);
+	//! Publishes a sorted list of tag numbers in RAM, returns the previous list
+	const byte* setTagList(const byte* list, unsigned int count);
+	//! Returns true if the tag number is found in the published list
+	boolean isTagListed();
+	//! Returns true while isTagListed() is searching a list, e.g. one replaced by setTagList()
+	boolean isTagListInUse(const byte* list) { return list != 0 && tagListInUse == list; };
 	//! Returns the error code of the last executed command
 	char getErrorCode() { return errorCode; };
 	//! Returns a human-readable error message corresponding to the error code
 	const char* getErrorMessage();
+	//! Returns true if the last executed command succeeded ('L' is login successful, but seek in progress for SEEK_TAG)
+	boolean isOK() { return errorCode == 0 || (errorCode == 'L' && getCommand() != CMD_SEEK_TAG); };
+	//! Returns the time (in millis) at which the next I2C transaction may start
+	unsigned long getNextSlot() { return t; };
+	//! Returns the accumulated time spent in idle sleep (in micros, wraps around)
+	unsigned long getIdleTime() { return idleTime; };
+	//! Idles the MCU until the next interrupt if no reader event is due
+	void idle();
+	//! Returns the number of commands transmitted
+	unsigned long getCommandCount() { return commands; };
+	//! Returns the number of response packets received
+	unsigned long getResponseCount() { return responses; };
+	//! Returns the number of polls that returned no response
+	unsigned long getPollCount() { return polls; };
+	//! Returns the number of dropped responses to another command than the last one
+	unsigned long getStaleCount() { return staleResponses; };
+	//! Returns the number of responses with a bad checksum
+	unsigned long getChecksumErrors() { return checksumErrors; };
+	//! Returns the number of bytes transferred over I2C, including address bytes
+	unsigned long getBusBytes() { return busBytes; };
+	//! Returns the accumulated time spent in a phase (PHASE_XX, in micros, wraps around)
+	unsigned long getPhaseTime(byte phase) { return phaseTime[phase]; };
+	//! Returns the number of SEEK and SELECT attempts
+	unsigned long getSelectCount() { return selects; };
+	//! Returns the number of SEEK and SELECT attempts that found a tag
+	unsigned long getDetectionCount() { return detections; };
+	//! Returns the number of NO_TAG errors while a tag was known present
+	unsigned long getLostTagCount() { return lostTags; };
+	//! Returns the number of failed authentications
+	unsigned long getAuthFailures() { return authFailures; };
+	//! Returns the number of failed reads
+	unsigned long getReadFailures() { return readFailures; };
+	//! Returns the number of failed authentications and reads of a sector (0-15, saturates at 255)
+	byte getSectorFailures(byte sector) { return sectorFailures[sector]; };
+	//! Returns the number of first reads in a time-to-first-read bucket, see printStats()
+	unsigned int getFirstReads(byte bucket) { return firstReads[bucket]; };
+	//! Prints the transaction and reliability counters to Serial in Prometheus text format
+	void printStats();
 	//! Returns the antenna power level (0 or 1)
 	byte getAntennaPower() { return antennaPower; };
 	//! Sends a SEEK_TAG command
@@ -126,20 +237,72 @@ public:
 	void writeBlock(byte block, const char* message);
 	//! Writes a null-terminated string of maximum 3 characters to a Mifare Ultralight
 	void writeFourByteBlock(byte block, const char* message);
+	//! Writes a null-terminated string of maximum 3 characters to a Mifare Ultralight page
+	void writePage(byte page, const char* message) { writeFourByteBlock(page, message); };
 	//! Sends a AUTHENTICATE command using the transport key
 	void authenticate(byte block);
 	//! Sends a AUTHENTICATE command using the specified key
 	void authenticate(byte block, byte keyType, byte key[6]);
+	//! Sends a AUTHENTICATE command for a block using the transport key
+	void authenticateBlock(byte block) { authenticate(block); };
+	//! Sends a AUTHENTICATE command for a block using the specified key
+	void authenticateBlock(byte block, byte keyType, byte key[6]) { authenticate(block, keyType, key); };
 	//! Reads a 16-byte block
 	void readBlock(byte block);
+	//! Sets the output port, sent between tag commands or during a seek
+	void writePort(byte value);
+	//! Returns true if the cached input port value is fresh, otherwise requests a new value
+	boolean readPort(unsigned int maxAge);
+	//! Returns the cached input port value
+	byte getPort() { return portIn; };
 
 private:
 	//! Send single-byte command
 	void sendCommand(byte cmd);
-	//! Transmit command packet over I2C
+	//! Returns true if the next I2C transaction may start
+	boolean slotFree() { return (long)(millis() - t) >= 0; };
+	//! Returns true if a port command may be sent now: in a free slot with no tag command outstanding, or during a seek
+	boolean outputFree() { return slotFree() && !pending && (!waiting || cmd == CMD_SEEK_TAG); };
+	//! Answers a command locally if the selected tag type does not support it
+	boolean routeCommand(byte command);
+	//! Make up a response to a command that is not sent to the module
+	void localResponse(byte command, char status);
+	//! Send pending output changes or poll the input port, returns true if the slot was used
+	boolean flushOutput();
+	//! Queue SEEK_TAG again if a port command cancelled a seek
+	void resumeSeek();
+	//! Wait for the next I2C slot and reserve the one after it
+	void waitForSlot();
+	//! Send the command waiting for its slot, waits for the slot if needed
+	void sendPending();
+	//! Put the MCU in idle sleep until the next interrupt
+	void sleepMCU();
+	//! Binary search for the tag number in a sorted list
+	boolean searchTag(const byte* list, unsigned int count, int (*compare)(const void*, const void*, size_t));
+	//! Queue command packet, sent over I2C in the next free slot
 	void transmitData();
-	//! Receive response packet over I2C
-	byte receiveData(byte length);
+	//! Write a packet with checksum over I2C
+	void writePacket(const byte* packet);
+	//! Receive response packet to a command over I2C
+	byte receiveData(byte length, byte command, byte* packet);
+	//! Reads the newest valid state slot from EEPROM, returns its slot number or -1
+	int readState(int eeAddress, State* state);
+	//! Add the time since start to a phase
+	void addPhase(byte phase, unsigned long start) { phaseTime[phase] += micros() - start; };
+	//! Print a single counter in Prometheus text format
+	void printMetric(const char* name, unsigned long value);
+	//! Print the phase times in Prometheus text format, longest first
+	void printPhases();
+	//! Update the reliability counters for a response
+	void countResult();
+	//! Count a failed authentication or read of a block's sector
+	void countSectorFailure(byte sector);
+	//! Print the reliability counters in Prometheus text format
+	void printReliability();
+	//! Returns the name of a phase
+	const char* phaseName(byte phase);
+	//! Returns the sector of a block, Mifare 4K sectors from 32 up have 16 blocks
+	static byte blockSector(byte block) { return block < 128 ? block >> 2 : 32 + ((block - 128) >> 4); };
 	//! Returns human-readable tag name corresponding to tag type
 	const char* tagName(byte type);
 };
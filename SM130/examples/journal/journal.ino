@@ -0,0 +1,537 @@
+// SM130 - journal tag events in EEPROM before acknowledging them on the serial port
+
+// Controls a SonMicro SM130/mini RFID reader or RFIDuino by I2C
+// Arduino analog input 4 is I2C SDA (SM130/mini pin 10/6)
+// Arduino analog input 5 is I2C SCL (SM130/mini pin 9/5)
+// Arduino digital input 4 is DREADY (SM130/mini pin 21/18)
+// Arduino digital output 3 is RESET (SM130/mini pin 18/14)
+
+// Every tag event is appended to a circular journal in EEPROM, and only
+// acknowledged ("ACK <seq>") once it has been written.
+// Writing EEPROM takes about 3.4ms per byte, so events are buffered in RAM
+// and committed as a group, when the buffer is full or when the oldest
+// buffered event has waited COMMIT_TIME.
+// Each record has a sequence number and a checksum. After a power failure,
+// the journal is recovered up to the last complete record, and a torn
+// record is simply overwritten by the next commit.
+// Events are stored once, in a ring buffer. The journal and the uplink
+// each consume them in place, with their own cursor. The journal never
+// loses events, but the uplink may fall behind when the serial port is
+// slower than the tag rate: it then skips the overwritten events and
+// reports how many were lost ("LOST <n>").
+// A small hash index maps each tag to its newest event, for "last seen"
+// queries. Events missed by the uplink while the link was down can be
+// uploaded later from the journal: the sync cursor in EEPROM tracks the
+// first event the host has not confirmed yet.
+//
+// Commands:
+// D - dump the journal
+// Q<tag> - query when a tag was last seen, e.g. Q04A1B2C3
+// U - upload events after the sync cursor ("SYNC <seq> ..." lines)
+// K - confirm the last upload, advancing the sync cursor ("NO UPLOAD" if
+//     there is no unconfirmed upload)
+//
+// With SIMULATE set to 1, the reader is replaced by a stand-in (see
+// SimulatedReader) that answers the same polls with a synthetic workload
+// (see nextTap). It runs on a virtual clock that advances one 20ms reader
+// slot per poll instead of waiting for it, so traffic runs faster than real
+// time, as fast as loop() and the serial output allow. The journal and the
+// sync cursor are then kept in RAM, so the EEPROM is not worn, and commits
+// take no EEPROM write time. The same SEED always produces the same
+// traffic, to compare runs with different settings.
+
+#include <Wire.h>
+#include <SM130.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+
+// Synthetic workload: on/off, random seed, mean time between taps (ms),
+// number of distinct tags, and rush hour rate multiplier
+#define SIMULATE 0
+#define SEED 1
+#define MEAN_INTERVAL 2000
+#define USERS 50
+#define RUSH_RATE 5
+
+// Journal size in records (16 bytes each), the sync cursor is stored after it.
+// When simulating, the journal is kept in RAM, which has room for fewer records
+#if SIMULATE
+#define JOURNAL_RECORDS 24
+#else
+#define JOURNAL_RECORDS 63
+#endif
+#define SYNC_CURSOR (JOURNAL_RECORDS * sizeof(Record))
+
+// Size of the last seen index (must be a power of 2)
+#define INDEX_SIZE 32
+
+// Event ring buffer size (must be a power of 2)
+#define RING_SIZE 16
+
+// Group commit: maximum number of buffered events and maximum delay (ms)
+#define GROUP_SIZE 8
+#define COMMIT_TIME 1000
+
+// Consumers of the event ring
+#define JOURNAL 0
+#define UPLINK 1
+#define CONSUMERS 2
+
+// Ignore the same tag for this long (ms) while it stays in the field
+#define REPEAT_TIME 1000
+
+// Journal record
+struct Record
+{
+  unsigned int seq; // sequence number
+  unsigned long time; // time of detection (millis)
+  byte tag[7]; // tag number, padded with zeroes
+  byte tagLength; // length of tag number
+  byte outcome; // tag type, or 0 if unknown
+  byte crc; // CRC-8 of all preceding bytes
+};
+
+// Global vars
+Record ring[RING_SIZE]; // event ring buffer
+unsigned int produced; // number of events put in the ring
+unsigned int consumed[CONSUMERS]; // number of events taken from the ring, per consumer
+unsigned int nextSeq; // sequence number of next event
+byte head; // journal slot for next record
+Record record; // record read from the journal
+unsigned int lastSeen[INDEX_SIZE]; // sequence number + 1 of the newest event per tag hash, 0 if none
+unsigned int uploadEnd; // sequence number after the last uploaded event
+boolean uploading; // true from an upload until the host confirms it
+unsigned long virtualClock; // virtual time (ms) when simulating
+
+#if SIMULATE
+byte simulatedEeprom[SYNC_CURSOR + sizeof(unsigned int)]; // journal and sync cursor
+
+unsigned long nextTap(unsigned long at, byte *tag);
+
+// Stand-in for the SM130 in SEEK mode, with the part of its interface used
+// here. Every available() call is a poll in the next 20ms slot, and the
+// virtual clock jumps to that slot. A poll at or after the next synthetic tap
+// returns its tag, and seekTag() takes a slot to restart the seek, like the
+// SM130 does.
+class SimulatedReader
+{
+  unsigned long slot; // virtual time of the next poll
+  unsigned long tap; // virtual time of the next tap
+  byte tapTag[4]; // tag number of the next tap
+  byte tag[4]; // tag number returned by the last poll
+  boolean seeking; // true while a SEEK_TAG is outstanding
+
+public:
+  void reset() { tap = nextTap(0, tapTag); seeking = false; };
+  void seekTag() { seeking = true; slot += 20; };
+  void idle() {};
+  byte* getTagNumber() { return tag; };
+  byte getTagLength() { return 4; };
+  byte getTagType() { return SM130::MIFARE_1K; };
+
+  boolean available()
+  {
+    if(!seeking)
+    {
+      return false;
+    }
+    virtualClock = slot;
+    slot += 20;
+    if(virtualClock < tap)
+    {
+      return false;
+    }
+    memcpy(tag, tapTag, sizeof(tag));
+    tap = nextTap(tap, tapTag);
+    seeking = false;
+    return true;
+  };
+};
+
+SimulatedReader RFIDuino;
+#else
+// Create SM130 instance for RFIDuino
+SM130 RFIDuino;
+#endif
+
+void setup()
+{
+  Wire.begin();
+  Serial.begin(115200);
+  Serial.println("RFIDuino journal");
+
+  // find the end of the journal
+  recoverJournal();
+  Serial.print("Next sequence ");
+  Serial.println(nextSeq);
+  produced = consumed[JOURNAL] = consumed[UPLINK] = uploadEnd = nextSeq;
+  rebuildIndex();
+
+#if SIMULATE
+  randomSeed(SEED);
+#endif
+
+  // reset RFIDuino and start SEEK mode
+  RFIDuino.reset();
+  RFIDuino.seekTag();
+}
+
+void loop()
+{
+  // check for command from serial port
+  if(Serial.available() > 0)
+  {
+    switch(Serial.read())
+    {
+    case 'd':
+    case 'D':
+      dumpJournal();
+      break;
+    case 'q':
+    case 'Q':
+      queryTag();
+      break;
+    case 'u':
+    case 'U':
+      uploadJournal();
+      break;
+    case 'k':
+    case 'K':
+      // host has received the upload, a confirmation without one would skip events
+      if(uploading)
+      {
+        writeJournal(&uploadEnd, SYNC_CURSOR, sizeof(uploadEnd));
+        uploading = false;
+      }
+      else
+      {
+        Serial.println("NO UPLOAD");
+      }
+      break;
+    }
+  }
+
+  // tag detected?
+  if(RFIDuino.available())
+  {
+    if(RFIDuino.getTagLength() > 0)
+    {
+      appendEvent(RFIDuino.getTagNumber(), RFIDuino.getTagLength(), RFIDuino.getTagType());
+    }
+    RFIDuino.seekTag();
+  }
+
+  // commit when the group is full, or when the oldest event has waited long enough
+  unsigned int pending = produced - consumed[JOURNAL];
+  if(pending >= GROUP_SIZE || (pending > 0 && now() - ring[consumed[JOURNAL] % RING_SIZE].time >= COMMIT_TIME))
+  {
+    commitJournal();
+  }
+
+  // acknowledge one committed event per loop, so the uplink never holds up tag processing
+  if(consumed[UPLINK] != consumed[JOURNAL])
+  {
+    acknowledgeEvent();
+  }
+}
+
+// Current time, virtual when simulating
+unsigned long now()
+{
+  return SIMULATE ? virtualClock : millis();
+}
+
+// Schedule the next synthetic tap after the one at virtual time 'at', and
+// put its tag number in 'tag'. Returns the virtual time of the next tap.
+// Taps arrive as a Poisson process, RUSH_RATE times faster during the first
+// 6 minutes of every virtual hour. Low tag numbers tap more often than high
+// ones, like regular users. Some taps wobble at the edge of the field and
+// are detected again shortly after, and some are two stacked cards.
+unsigned long nextTap(unsigned long at, byte *tag)
+{
+  static boolean repeat; // this tap was scheduled by the previous one
+  byte rate = at % 3600000 < 360000 ? RUSH_RATE : 1;
+
+  long r = random(100);
+  if(!repeat && r < 10)
+  {
+    // wobble: same tag again, within twice the repeat time
+    repeat = true;
+    return at + random(50, 2 * REPEAT_TIME);
+  }
+  if(!repeat && r < 15)
+  {
+    // stacked cards: another tag right after this one
+    tag[3]++;
+    repeat = true;
+    return at + 20;
+  }
+
+  // next user: exponential time between taps, -ln(1 - u) * mean / rate
+  unsigned int user = random(USERS) * random(USERS) / USERS;
+  tag[0] = 0x5E;
+  tag[1] = 0x11;
+  tag[2] = user >> 8;
+  tag[3] = user;
+  repeat = false;
+  return at + (unsigned long)(-log(1 - random(10000) / 10000.0) * MEAN_INTERVAL / rate);
+}
+
+// Put a tag event in the ring buffer
+void appendEvent(byte *tag, byte tagLength, byte type)
+{
+  static Record last;
+  Record e;
+
+  memset(&e, 0, sizeof(Record));
+  e.time = now();
+  e.tagLength = tagLength;
+  memcpy(e.tag, tag, tagLength);
+  e.outcome = type;
+
+  // suppress repeated detections of the same tag
+  if(memcmp(e.tag, last.tag, sizeof(e.tag)) == 0 && e.time - last.time < REPEAT_TIME)
+  {
+    last.time = e.time;
+    return;
+  }
+  last = e;
+
+  // the journal must not lose events, so commit now if it would be overwritten
+  if(produced - consumed[JOURNAL] == RING_SIZE)
+  {
+    commitJournal();
+  }
+  e.seq = nextSeq++;
+  e.crc = checksum((byte*)&e);
+  ring[produced++ % RING_SIZE] = e;
+  lastSeen[hash(e.tag)] = e.seq + 1;
+}
+
+// Find the event with the given sequence number, in the ring or the journal.
+// Returns true if found, the event is then in 'record'
+boolean findEvent(unsigned int seq)
+{
+  unsigned int age = produced - seq;
+  if(age == 0)
+  {
+    return false;
+  }
+  if(age <= produced - consumed[JOURNAL])
+  {
+    // not committed yet
+    record = ring[seq % RING_SIZE];
+    return true;
+  }
+  // committed: count back from the head of the journal
+  age -= produced - consumed[JOURNAL];
+  return age <= JOURNAL_RECORDS
+    && readRecord((head + JOURNAL_RECORDS - age) % JOURNAL_RECORDS)
+    && record.seq == seq;
+}
+
+// Print when the tag read from the serial port was last seen
+void queryTag()
+{
+  byte tag[7];
+  memset(tag, 0, sizeof(tag));
+  byte len = readHex(tag, sizeof(tag));
+  unsigned int seq = lastSeen[hash(tag)];
+  if(len > 0 && seq > 0 && findEvent(seq - 1) && memcmp(record.tag, tag, sizeof(tag)) == 0)
+  {
+    Serial.print("SEEN ");
+    Serial.print(record.seq);
+    Serial.print(' ');
+    Serial.println(record.time);
+  }
+  else
+  {
+    Serial.println("NOT SEEN");
+  }
+}
+
+// Print all events in the journal that the host has not confirmed yet
+void uploadJournal()
+{
+  unsigned int seq;
+  readJournal(&seq, SYNC_CURSOR, sizeof(seq));
+  // events older than the journal are lost
+  if(consumed[JOURNAL] - seq > JOURNAL_RECORDS)
+  {
+    seq = consumed[JOURNAL] - JOURNAL_RECORDS;
+  }
+  for(; seq != consumed[JOURNAL]; seq++)
+  {
+    if(findEvent(seq))
+    {
+      Serial.print("SYNC ");
+      printRecord();
+    }
+  }
+  uploadEnd = seq;
+  uploading = true;
+}
+
+// Fill the last seen index from the journal, oldest event first
+void rebuildIndex()
+{
+  for(byte i = 0; i < JOURNAL_RECORDS; i++)
+  {
+    if(readRecord((head + i) % JOURNAL_RECORDS))
+    {
+      lastSeen[hash(record.tag)] = record.seq + 1;
+    }
+  }
+}
+
+// Index of a tag in the last seen index
+byte hash(byte *tag)
+{
+  byte h = 0;
+  for(byte i = 0; i < 7; i++)
+  {
+    h = h * 31 + tag[i];
+  }
+  return h & (INDEX_SIZE - 1);
+}
+
+// Read a tag number in hexadecimal from the serial port, returns its length in bytes
+byte readHex(byte *tag, byte len)
+{
+  byte n = 0;
+  while(n < len * 2)
+  {
+    delay(5);
+    if(Serial.available() == 0)
+    {
+      break;
+    }
+    char c = Serial.read();
+    byte nibble;
+    if(c >= '0' && c <= '9') nibble = c - '0';
+    else if(c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+    else if(c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+    else break;
+    tag[n / 2] = tag[n / 2] << 4 | nibble;
+    n++;
+  }
+  return n / 2;
+}
+
+// Write all events not yet in the journal
+void commitJournal()
+{
+  for(; consumed[JOURNAL] != produced; consumed[JOURNAL]++)
+  {
+    writeJournal(&ring[consumed[JOURNAL] % RING_SIZE], head * sizeof(Record), sizeof(Record));
+    head = (head + 1) % JOURNAL_RECORDS;
+  }
+}
+
+// Acknowledge the next committed event on the serial port
+void acknowledgeEvent()
+{
+  // skip events that have been overwritten already
+  if(produced - consumed[UPLINK] > RING_SIZE)
+  {
+    Serial.print("LOST ");
+    Serial.println(produced - RING_SIZE - consumed[UPLINK]);
+    consumed[UPLINK] = produced - RING_SIZE;
+  }
+  Record *r = &ring[consumed[UPLINK]++ % RING_SIZE];
+  Serial.print("ACK ");
+  Serial.print(r->seq);
+  Serial.print(' ');
+  printArrayHex(r->tag, r->tagLength);
+  Serial.println();
+}
+
+// Find the slot after the newest complete record, and the next sequence number.
+// The journal ends at the first record that is torn, blank or out of sequence.
+void recoverJournal()
+{
+  // the record before slot 0 is the last slot
+  boolean valid = readRecord(JOURNAL_RECORDS - 1);
+  unsigned int seq = record.seq;
+
+  for(head = 0; head < JOURNAL_RECORDS; head++)
+  {
+    boolean prev = valid;
+    valid = readRecord(head);
+    if(head > 0 && (!valid || record.seq != (unsigned int)(seq + 1)))
+    {
+      break;
+    }
+    if(head == 0 && !valid)
+    {
+      // empty journal, or torn record in slot 0
+      valid = prev;
+      break;
+    }
+    seq = record.seq;
+  }
+  head %= JOURNAL_RECORDS;
+  nextSeq = valid || head > 0 ? seq + 1 : 0;
+}
+
+// Print all records in the journal, oldest first
+void dumpJournal()
+{
+  for(byte i = 0; i < JOURNAL_RECORDS; i++)
+  {
+    if(readRecord((head + i) % JOURNAL_RECORDS))
+    {
+      printRecord();
+    }
+  }
+}
+
+// Print the record in 'record'
+void printRecord()
+{
+  Serial.print(record.seq);
+  Serial.print(' ');
+  Serial.print(record.time);
+  Serial.print(' ');
+  printArrayHex(record.tag, record.tagLength);
+  Serial.print(' ');
+  Serial.println(record.outcome);
+}
+
+// Read a record from the journal into 'record', returns true if it is complete
+boolean readRecord(byte slot)
+{
+  readJournal(&record, slot * sizeof(Record), sizeof(Record));
+  return record.tagLength <= sizeof(record.tag) && record.crc == checksum((byte*)&record);
+}
+
+// Read from the journal area, in RAM when simulating
+void readJournal(void *dst, int address, size_t n)
+{
+#if SIMULATE
+  memcpy(dst, simulatedEeprom + address, n);
+#else
+  eeprom_read_block(dst, (const void*)address, n);
+#endif
+}
+
+// Write to the journal area, in RAM when simulating so the EEPROM is not worn
+void writeJournal(const void *src, int address, size_t n)
+{
+#if SIMULATE
+  memcpy(simulatedEeprom + address, src, n);
+#else
+  eeprom_update_block(src, (void*)address, n);
+#endif
+}
+
+// CRC-8 of a record, excluding the CRC field
+byte checksum(byte *p)
+{
+  byte crc = 0;
+  for(byte i = 0; i < sizeof(Record) - 1; i++)
+  {
+    crc = _crc_ibutton_update(crc, p[i]);
+  }
+  return crc;
+}
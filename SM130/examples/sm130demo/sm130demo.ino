@@ -37,9 +37,12 @@ void setup()
   // reset RFIDuino
   RFIDuino.reset();
 
-  // read firmware version
-  Serial.print("Version ");
-  Serial.println(RFIDuino.getFirmwareVersion());
+  // load the firmware version saved at a previous start, so it needs no query
+  RFIDuino.loadState(0);
+
+  // read firmware version, and save it if it was not known yet
+  printVersion();
+  RFIDuino.saveState(0);
   
   // help
   Serial.println("Type ? for help");
@@ -61,6 +64,7 @@ void loop()
       Serial.println("R - Read sector");
       Serial.println("W - Write string");
       Serial.println("V - Version");
+      Serial.println("T - Statistics");
       Serial.println("Q - Sleep");
       Serial.println("X - Reset");
       break;
@@ -121,8 +125,12 @@ void loop()
     case 'v':
     case 'V':
       // read firmware version
-      Serial.print("Version ");
-      Serial.println(RFIDuino.getFirmwareVersion());
+      printVersion();
+      break;
+    case 't':
+    case 'T':
+      // print transaction counters
+      RFIDuino.printStats();
       break;
     case 'q':
     case 'Q':
@@ -146,26 +154,48 @@ void loop()
     // check for errors, 0 means no error, L means logged in
     if(RFIDuino.getErrorCode() != 0 && RFIDuino.getErrorCode() != 'L')
     {
-      Serial.println(RFIDuino.getErrorMessage());
-      action = NONE;
+      if(action == READ && (RFIDuino.getCommand() == SM130::CMD_AUTHENTICATE || RFIDuino.getCommand() == SM130::CMD_READ16))
+      {
+        // record the failed blocks in the dump (the whole sector if login failed),
+        // and continue with the next block, which needs a new select after a failure
+        if(skipBlocks(RFIDuino.getCommand() == SM130::CMD_AUTHENTICATE ? 4 - (block & 0x03) : 1))
+        {
+          RFIDuino.selectTag();
+        }
+        else
+        {
+          RFIDuino.haltTag();
+          action = NONE;
+        }
+      }
+      else
+      {
+        Serial.println(RFIDuino.getErrorMessage());
+        action = NONE;
+      }
     }
     else // deal with response
     {
       switch(RFIDuino.getCommand())
       {
       case SM130::CMD_SEEK_TAG:
-        if(RFIDuino.getErrorCode() == 'L' || action == NONE)
+        if(RFIDuino.getErrorCode() == 'L')
         {
-          // seek in progress, or auto-seek after reset, which we ignore
+          // seek in progress
           break;
         }
       case SM130::CMD_SELECT_TAG:
         // store tag type
         tagType = RFIDuino.getTagType();
-        // show tag name and serial number
-        Serial.print(RFIDuino.getTagName());
-        Serial.print(": ");
-        Serial.println(RFIDuino.getTagString());
+        // show tag name, serial number and time, unless reselected during a read
+        if(action != READ || block == 0)
+        {
+          Serial.print(RFIDuino.getTagName());
+          Serial.print(": ");
+          Serial.print(RFIDuino.getTagString());
+          Serial.print(" at ");
+          Serial.println(millis());
+        }
         // in case of read or write action, authenticate first
         if(action == READ || action == WRITE)
         {
@@ -258,6 +288,29 @@ void loop()
   }
 }
 
+// Print the firmware version, or a message if the module did not respond
+void printVersion()
+{
+  const char* version = RFIDuino.getFirmwareVersion();
+  Serial.print("Version ");
+  Serial.println(version ? version : "unknown, no response");
+}
+
+// Print the error message for blocks that could not be read, and skip them
+// Returns true if there are blocks left to read
+boolean skipBlocks(byte n)
+{
+  while(n-- && block < numBlocks)
+  {
+    Serial.print("Block ");
+    printHex(block);
+    Serial.print(": ");
+    Serial.println(RFIDuino.getErrorMessage());
+    ++block;
+  }
+  return block < numBlocks;
+}
+
 int readQuotedString(char *s, int len)
 {
   int i = 0;
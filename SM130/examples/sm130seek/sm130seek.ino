@@ -25,14 +25,8 @@ void setup()
   Serial.println("RFIDuino");
 
   // Reset RFIDuino, this will also configure IO pins DREADY and RESET
-  RFIDuino.reset();
-
-  // Read firmware version (optional)
-  Serial.print("Version ");
-  Serial.println(RFIDuino.getFirmwareVersion());
-
-  // Start SEEK mode
-  RFIDuino.seekTag();
+  // The SM130 starts seeking at power-up, keep it seeking to find the first tag fast
+  RFIDuino.reset(true);
 }
 
 void loop()
@@ -40,12 +34,19 @@ void loop()
   // Tag detected?
   if(RFIDuino.available())
   {
-    // Print the tag's type and serial number
+    // Print the tag's type and serial number, and the time since power-up
     Serial.print(RFIDuino.getTagName());
     Serial.print(": ");
-    Serial.println(RFIDuino.getTagString());
+    Serial.print(RFIDuino.getTagString());
+    Serial.print(" at ");
+    Serial.println(millis());
 
     // Start new SEEK
     RFIDuino.seekTag();
   }
+  else
+  {
+    // Nothing to do, idle the MCU until the next interrupt
+    RFIDuino.idle();
+  }
 }
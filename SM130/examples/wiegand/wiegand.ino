@@ -0,0 +1,223 @@
+// SM130 - send detected tags to an access panel in Wiegand format
+
+// Controls a SonMicro SM130/mini RFID reader or RFIDuino by I2C
+// Arduino analog input 4 is I2C SDA (SM130/mini pin 10/6)
+// Arduino analog input 5 is I2C SCL (SM130/mini pin 9/5)
+// Arduino digital input 4 is DREADY (SM130/mini pin 21/18)
+// Arduino digital output 3 is RESET (SM130/mini pin 18/14)
+// Arduino digital output 5 is Wiegand DATA0, digital output 6 is DATA1
+
+// Every detected tag is queued as a Wiegand frame, and the frames are sent
+// by the Timer1 compare interrupt, one pulse edge per interrupt. Sending a
+// frame takes about FORMAT x 2ms, but loop() never waits for it, so the
+// reader keeps being polled while frames go out.
+// A Wiegand frame is a leading parity bit over the first half of the data
+// bits, the data bits (MSB first), and a trailing parity bit over the second
+// half. The standard formats use even leading and odd trailing parity, some
+// panels expect them the other way round, see LEADING_PARITY.
+// Wiegand 26 sends the first 3 bytes of the tag number, Wiegand 34 the
+// first 4 bytes.
+// Timer1 is also used by the Servo library, they can't be used together.
+
+#include <Wire.h>
+#include <SM130.h>
+#include <avr/interrupt.h>
+
+// Wiegand format: 26 or 34 bits
+#define FORMAT 26
+
+// Parity of the leading and trailing parity bits: 0 for even, 1 for odd
+#define LEADING_PARITY 0
+#define TRAILING_PARITY 1
+
+// Wiegand output pins, idle high, pulled low for a bit
+#define DATA0 5
+#define DATA1 6
+
+// Pulse width, time from pulse to pulse, and gap between frames (us)
+#define PULSE_WIDTH 100
+#define PULSE_INTERVAL 2000
+#define FRAME_GAP 50000
+
+// Timer1 runs at F_CPU / 64, 4us per tick at 16MHz
+#define TICKS(us) ((us) / (64000000UL / F_CPU) - 1)
+
+// Number of queued frames (must be a power of 2)
+#define QUEUE_SIZE 8
+
+// Ignore the same tag for this long (ms) while it stays in the field
+#define REPEAT_TIME 1000
+
+// Frame queue, filled by loop() and emptied by the timer interrupt.
+// Volatile, so a frame is stored before tail is updated to publish it.
+volatile unsigned long frameData[QUEUE_SIZE]; // data bits
+volatile byte frameParity[QUEUE_SIZE]; // bit 1 is the leading, bit 0 the trailing parity bit
+volatile byte head; // next frame to send
+volatile byte tail; // next free entry
+volatile boolean sending; // true while the timer interrupt is enabled
+unsigned int dropped; // frames dropped because the queue was full
+
+// Sender state, only used by the timer interrupt
+byte bitIndex; // next bit of the current frame
+boolean pulse; // true while a pulse is on
+
+SM130 RFIDuino;
+
+// Last tag seen, to ignore repeated detections
+byte lastTag[7];
+unsigned long lastTime;
+
+void setup()
+{
+  pinMode(DATA0, OUTPUT);
+  pinMode(DATA1, OUTPUT);
+  digitalWrite(DATA0, HIGH);
+  digitalWrite(DATA1, HIGH);
+
+  // Timer1 in CTC mode, stopped until a frame is queued
+  TCCR1A = 0;
+  TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+  TIMSK1 = 0;
+
+  Wire.begin();
+  Serial.begin(115200);
+  Serial.print("Wiegand ");
+  Serial.println(FORMAT);
+
+  // Keep the SM130 seeking from power-up
+  RFIDuino.reset(true);
+}
+
+void loop()
+{
+  if(RFIDuino.available())
+  {
+    if(RFIDuino.getTagLength())
+    {
+      sendTag();
+    }
+    RFIDuino.seekTag();
+  }
+  else
+  {
+    RFIDuino.idle();
+  }
+}
+
+// Queue a frame for the detected tag, unless it was just sent
+void sendTag()
+{
+  byte* tag = RFIDuino.getTagNumber();
+  byte len = RFIDuino.getTagLength();
+
+  // Ignore the same tag while it stays in the field
+  if(memcmp(tag, lastTag, len) == 0 && millis() - lastTime < REPEAT_TIME)
+  {
+    lastTime = millis();
+    return;
+  }
+  memset(lastTag, 0, sizeof(lastTag));
+  memcpy(lastTag, tag, len);
+  lastTime = millis();
+
+  // Data bits: the first bytes of the tag number, MSB first
+  unsigned long data = 0;
+  for(byte i = 0; i < (FORMAT - 2) / 8; i++)
+  {
+    data = (data << 8) | tag[i];
+  }
+
+  if(queueFrame(data))
+  {
+    Serial.print("Sent ");
+    Serial.println(RFIDuino.getTagString());
+  }
+  else
+  {
+    Serial.print("Queue full, dropped ");
+    Serial.println(++dropped);
+  }
+}
+
+// Add a frame to the queue, and start the timer if it is idle
+boolean queueFrame(unsigned long data)
+{
+  byte next = (tail + 1) & (QUEUE_SIZE - 1);
+  if(next == head)
+  {
+    return false;
+  }
+
+  // Parity bits: leading over the first half, trailing over the second half
+  byte half = (FORMAT - 2) / 2;
+  byte leading = LEADING_PARITY, trailing = TRAILING_PARITY;
+  for(byte i = 0; i < half; i++)
+  {
+    trailing ^= (data >> i) & 1;
+    leading ^= (data >> (i + half)) & 1;
+  }
+  frameData[tail] = data;
+  frameParity[tail] = (leading << 1) | trailing;
+  tail = next;
+
+  if(!sending)
+  {
+    sending = true;
+    bitIndex = 0;
+    pulse = false;
+    TCNT1 = 0;
+    OCR1A = TICKS(PULSE_INTERVAL);
+    // clear a compare match left from the last frame, it would fire right away
+    TIFR1 = _BV(OCF1A);
+    TIMSK1 = _BV(OCIE1A);
+  }
+  return true;
+}
+
+// Send the queue, one pulse edge per interrupt
+ISR(TIMER1_COMPA_vect)
+{
+  if(pulse)
+  {
+    // End of a pulse: release both lines, and wait for the next bit or frame
+    digitalWrite(DATA0, HIGH);
+    digitalWrite(DATA1, HIGH);
+    pulse = false;
+    if(++bitIndex < FORMAT)
+    {
+      OCR1A = TICKS(PULSE_INTERVAL - PULSE_WIDTH);
+    }
+    else
+    {
+      bitIndex = 0;
+      head = (head + 1) & (QUEUE_SIZE - 1);
+      OCR1A = TICKS(FRAME_GAP);
+    }
+  }
+  else if(head != tail)
+  {
+    // Start a pulse on DATA1 for a 1 bit, or on DATA0 for a 0 bit
+    boolean one;
+    if(bitIndex == 0)
+    {
+      one = frameParity[head] & 2;
+    }
+    else if(bitIndex == FORMAT - 1)
+    {
+      one = frameParity[head] & 1;
+    }
+    else
+    {
+      one = (frameData[head] >> (FORMAT - 2 - bitIndex)) & 1;
+    }
+    digitalWrite(one ? DATA1 : DATA0, LOW);
+    pulse = true;
+    OCR1A = TICKS(PULSE_WIDTH);
+  }
+  else
+  {
+    // Queue empty, stop until the next frame
+    TIMSK1 = 0;
+    sending = false;
+  }
+}